@@ -90,6 +90,18 @@ _csiReg2bins(String<__uint32> & list, __uint64 beg, __uint64 end, __int32 minShi
     }
 }
 
+// Returns the smallest bin holding [beg, end), as hts_reg2bin() of htslib.
+
+static inline __uint32
+_csiReg2bin(__int64 beg, __int64 end, __int32 minShift, __int32 depth)
+{
+    int l, s = minShift, t = ((1 << (depth * 3)) - 1) / 7;
+    for (--end, l = depth; l > 0; --l, s += 3, t -= 1 << (l * 3))
+        if (beg >> s == end >> s)
+            return t + (beg >> s);
+    return 0;
+}
+
 template <typename TSpec>
 inline bool
 jumpToRegion(FormattedFile<Bam, Input, TSpec> & bamFile,
@@ -169,13 +181,72 @@ jumpToRegion(FormattedFile<Bam, Input, TSpec> & bamFile,
 // Function jumpToOrphans()
 // ----------------------------------------------------------------------------
 
-template <typename TSpec, typename TNameStore, typename TNameStoreCache>
-bool jumpToOrphans(FormattedFile<Bam, Input, TSpec> & /*bamFile*/,
-                   bool & /*hasAlignments*/,
-                   BamIndex<Csi> const & /*index*/)
+// The file offset behind the last alignment with a reference: the largest end
+// offset in the metabins, or of any chunk if the index has no metabins. Returns 0
+// for an index without chunks.
+
+inline __uint64
+_csiOrphansOffset(BamIndex<Csi> const & index)
 {
-    SEQAN_FAIL("This does not work yet!");
-    return false;
+    typedef BamIndex<Csi>::TBinIndex_::const_iterator TMapIter;
+
+    __uint32 metaBin = ((1u << ((index._depth + 1) * 3)) - 1) / 7 + 1;
+    __uint64 metaOffset = 0, chunkOffset = 0;
+    for (unsigned i = 0; i < length(index._binIndices); ++i)
+    {
+        for (TMapIter mIt = index._binIndices[i].begin(); mIt != index._binIndices[i].end(); ++mIt)
+        {
+            String<Pair<__uint64, __uint64> > const & chunks = mIt->second.chunkBegEnds;
+            if (mIt->first == metaBin)
+            {
+                // The first chunk of the metabin is the file range of the reference.
+                if (!empty(chunks))
+                    metaOffset = std::max(metaOffset, chunks[0].i2);
+                continue;
+            }
+            for (unsigned j = 0; j < length(chunks); ++j)
+                chunkOffset = std::max(chunkOffset, chunks[j].i2);
+        }
+    }
+
+    return (metaOffset != 0u) ? metaOffset : chunkOffset;
+}
+
+// Positions bamFile at the first alignment without reference. The alignments
+// of the references are skipped using the index; hasAlignments is false if the
+// file holds no such alignment.
+
+template <typename TSpec>
+bool jumpToOrphans(FormattedFile<Bam, Input, TSpec> & bamFile,
+                   bool & hasAlignments,
+                   BamIndex<Csi> const & index)
+{
+    if (!isEqual(format(bamFile), Bam()))
+        return false;
+
+    hasAlignments = false;
+
+    // Without chunks in the index, the search starts at the current position
+    // behind the header.
+    __uint64 offset = _csiOrphansOffset(index);
+    if (offset != 0u)
+        setPosition(bamFile, offset);
+
+    // Read until the first alignment without reference.
+    BamAlignmentRecord record;
+    while (!atEnd(bamFile))
+    {
+        offset = position(bamFile);
+        readRecord(record, bamFile);
+        if (record.rID == -1)
+        {
+            setPosition(bamFile, offset);
+            hasAlignments = true;
+            break;
+        }
+    }
+
+    return true;
 }
 
 // ----------------------------------------------------------------------------
@@ -190,12 +261,26 @@ getUnalignedCount(BamIndex<Csi> const & index)
 }
 
 // ----------------------------------------------------------------------------
-// Function open()
+// Helper Class NoIndexProgress_
 // ----------------------------------------------------------------------------
 
-template<typename TStream>
+// Ignores the number of complete references while the index is read.
+
+struct NoIndexProgress_
+{
+    void operator()(size_t /*numRefs*/)
+    {}
+};
+
+// ----------------------------------------------------------------------------
+// Function _readCsi()
+// ----------------------------------------------------------------------------
+
+// Reads a CSI from fin and calls onReference(i + 1) once reference i is complete.
+
+template<typename TStream, typename TProgress>
 bool
-open(BamIndex<Csi> & index, TStream & fin)
+_readCsi(BamIndex<Csi> & index, TStream & fin, TProgress & onReference)
 {
     // Read the magic number.
     CharString buffer;
@@ -293,6 +378,8 @@ open(BamIndex<Csi> & index, TStream & fin)
             // Copy bin data into index.
             index._binIndices[i][bin] = data;
         }
+
+        onReference(i + 1);
     }
 
     if (!fin.good())
@@ -311,10 +398,23 @@ open(BamIndex<Csi> & index, TStream & fin)
     return true;
 }
 
+// ----------------------------------------------------------------------------
+// Function open()
 // ----------------------------------------------------------------------------
 
+template<typename TStream>
 bool
-open(BamIndex<Csi> & index, char const * filename)
+open(BamIndex<Csi> & index, TStream & fin)
+{
+    NoIndexProgress_ onReference;
+    return _readCsi(index, fin, onReference);
+}
+
+// ----------------------------------------------------------------------------
+
+template<typename TProgress>
+bool
+open(BamIndex<Csi> & index, char const * filename, TProgress & onReference)
 {
     std::ifstream iss(filename);
     if (!iss.good())
@@ -325,27 +425,34 @@ open(BamIndex<Csi> & index, char const * filename)
         bgzf_istream fin(iss);
         if (!fin.good())
             return false;  // Could not open file.
-        return open(index, fin);
+        return _readCsi(index, fin, onReference);
     }
     else
     {
-        return open(index, iss);
+        return _readCsi(index, iss, onReference);
     }
 }
 
+// ----------------------------------------------------------------------------
+
+inline bool
+open(BamIndex<Csi> & index, char const * filename)
+{
+    NoIndexProgress_ onReference;
+    return open(index, filename, onReference);
+}
+
 // ----------------------------------------------------------------------------
 // Function saveIndex()
 // ----------------------------------------------------------------------------
 
-inline bool saveIndex(BamIndex<Csi> const & index, char const * filename)
+template <typename TStream>
+inline bool saveIndex(BamIndex<Csi> const & index, TStream & out)
 {
     typedef BamIndex<Csi> const                TBamIndex;
     typedef TBamIndex::TBinIndex_ const        TBinIndex;
     typedef TBinIndex::const_iterator          TBinIndexIter;
 
-    // Open output file.
-    std::ofstream out(filename, std::ios::binary | std::ios::out);
-
     // Write header.
     out.write("CSI\1", 4);
     __int32 minShift = index._minShift;
@@ -357,7 +464,7 @@ inline bool saveIndex(BamIndex<Csi> const & index, char const * filename)
     __int32 lenAux = length(index._aux);
     out.write(reinterpret_cast<char *>(&lenAux), 4);
     for (int i = 0; i < lenAux; ++i)
-        out.write(reinterpret_cast<char *>(index._aux[i]), 1);
+        out.write(reinterpret_cast<char const *>(&index._aux[i]), 1);
 
     // Write out binning index.
     __int32 numRefSeqs = length(index._binIndices);
@@ -396,6 +503,18 @@ inline bool saveIndex(BamIndex<Csi> const & index, char const * filename)
     return out.good();  // false on error, true on success.
 }
 
+// ----------------------------------------------------------------------------
+
+inline bool saveIndex(BamIndex<Csi> const & index, char const * filename)
+{
+    // Open output file.
+    std::ofstream out(filename, std::ios::binary | std::ios::out);
+    if (!out.is_open())
+        return false;
+
+    return saveIndex(index, out);
+}
+
 // ----------------------------------------------------------------------------
 // Function buildIndex()
 // ----------------------------------------------------------------------------
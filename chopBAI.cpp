@@ -1,11 +1,30 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <random>
+#include <set>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <unistd.h>
 
 #include <seqan/arg_parse.h>
 #include <seqan/bam_io.h>
+#include <seqan/file.h>
+#include <seqan/parallel.h>
 
 #include "bam_index_csi.h"
+#include "dir_watcher.h"
+#include "index_builder.h"
+#include "index_cache.h"
+#include "index_loader.h"
+#include "index_query.h"
+#include "output_writer.h"
+#include "region_reader.h"
+#include "shared_index.h"
 
 using namespace seqan;
 
@@ -16,24 +35,298 @@ struct ChopBaiOptions {
     // Input arguments
     CharString bamfile;
     String<CharString> regions;
+    CharString contigsFile;
+    bool bamList;
+    bool watchDir;
+    bool rechop;               // The input index is a reduced index of a parent region.
+    CharString parentRegion;   // The parent region, or empty for the index's directory name.
+    unsigned numShards;
 
     // Output options
     CharString outputPrefix;
     bool writeLinear;
     bool createSymlink;
+    bool fanOut;
+    bool optimize;
+    bool verify;
+    unsigned verifyQueries;
+    bool keepUnmapped;
+    bool addMates;
+    unsigned maxMateWindows;
+    unsigned csiMinShift;      // Rebuild the index as CSI with this minimal shift if not 0.
+    unsigned csiDepth;         // Depth of the rebuilt CSI, or 0 to cover the longest reference.
+
+    unsigned numThreads;
+    bool indexCache;
+    bool ioUring;
 
     ChopBaiOptions() :
-        outputPrefix("."), writeLinear(false), createSymlink(false)
+        bamList(false), watchDir(false), rechop(false), numShards(1), outputPrefix("."), writeLinear(false), createSymlink(false), fanOut(false), optimize(false),
+        verify(false), verifyQueries(1000), keepUnmapped(false), addMates(false),
+        maxMateWindows(1000), csiMinShift(0), csiDepth(0), numThreads(1), indexCache(false), ioUring(false)
     {}
 };
 
 
 // -----------------------------------------------------------------------------
 
-struct GenomicInterval {
-    size_t chrId;
-    __uint32 begin;
-    __uint32 end;
+// Names and lengths of the reference sequences with a hash table for looking up
+// the id of a name.
+
+struct ContigDictionary {
+    String<CharString> names;
+    String<__uint32> lengths;
+    std::unordered_map<std::string, size_t> ids;
+    bool checkLengths;         // Regions must end within the non-zero lengths.
+
+    ContigDictionary() :
+        checkLengths(false)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// The region names used for naming the output directories, in one concatenated string.
+
+typedef StringSet<CharString, Owner<ConcatDirect<> > > TRegionNames;
+
+
+// -----------------------------------------------------------------------------
+
+// The parsed regions, shared by all input bam files. The candidate bin ranges of a
+// region are looked up per query.
+
+struct RegionPlan {
+    String<GenomicInterval> intervals;
+    TRegionNames regionNames;
+    size_t numRefs;
+
+    RegionPlan() :
+        numRefs(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Sizes of the written indices.
+
+struct ChopStats {
+    __uint64 numIndices;
+    __uint64 bytesCropped;     // Size of the indices before optimization.
+    __uint64 bytesWritten;
+    __uint64 numUnverified;    // Optimized indices that failed verification.
+    __uint64 numVerified;      // Indices checked against the full index with --verify.
+    __uint64 numMismatches;    // Indices that resolved a query differently than the full index.
+    __uint64 numMateWindows;   // Windows added for the mates of the regions' reads with --mates.
+    __uint64 numMatesCapped;   // Regions with mates in more than --max-mate-windows windows.
+
+    ChopStats() :
+        numIndices(0), bytesCropped(0), bytesWritten(0), numUnverified(0), numVerified(0), numMismatches(0),
+        numMateWindows(0), numMatesCapped(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Reads the alignments of a region from the bam file to find the windows holding
+// their mates. Each thread keeps its own bam file open.
+
+struct MateScan {
+    CharString bamfile;
+    BamFileIn bamFile;
+    bool isOpen;
+    BamAlignmentRecord record;
+    std::set<std::pair<__int32, __uint32> > windows;  // Reference ids and windows of minimal size.
+    bool capped;               // Mates were found in more windows than allowed.
+
+    MateScan(CharString const & bamfile_) : bamfile(bamfile_), isOpen(false), capped(false)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Options of the profile subcommand.
+
+struct ProfileOptions {
+    CharString bamfile;
+    CharString contigsFile;
+    __uint32 windowSize;
+    bool writeLinear;
+    bool optimize;
+    bool json;
+
+    ProfileOptions() :
+        windowSize(1000000), writeLinear(false), optimize(false), json(false)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Options of the view subcommand.
+
+struct ViewOptions {
+    CharString bamfile;
+    CharString indexfile;
+    String<CharString> regions;
+    CharString outputFile;
+    unsigned numThreads;
+    unsigned readahead;        // In MB.
+    bool count;
+
+    ViewOptions() :
+        numThreads(1), readahead(16), count(false)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Options of the split subcommand.
+
+struct SplitOptions {
+    CharString bamfile;
+    CharString contigsFile;
+    CharString outputPrefix;
+    bool writeLinear;
+    bool createSymlink;
+    bool fanOut;
+    bool ioUring;
+
+    SplitOptions() :
+        outputPrefix("."), writeLinear(false), createSymlink(false), fanOut(false), ioUring(false)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Options of the count subcommand.
+
+struct CountOptions {
+    CharString bamfile;
+    CharString contigsFile;
+    String<CharString> regions;
+    unsigned numThreads;
+
+    CountOptions() :
+        numThreads(1)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Read counts of a reference from its metabin, and the file range of its
+// alignments that the counts are spread over in the count subcommand.
+
+struct ReferenceCounts {
+    bool known;                // The index has the metabin of the reference.
+    __uint64 mapped;
+    __uint64 unmapped;         // Unmapped reads placed on the reference.
+    __uint64 begOffset;
+    __uint64 endOffset;
+
+    ReferenceCounts() :
+        known(false), mapped(0), unmapped(0), begOffset(0), endOffset(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Estimated read counts and compressed bytes of a region in the count subcommand.
+
+struct RegionCounts {
+    __uint64 mapped;
+    __uint64 unmapped;
+    __uint64 numBytes;
+
+    RegionCounts() :
+        mapped(0), unmapped(0), numBytes(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Writes the index of each reference in the split subcommand as soon as the index
+// reader completes it, and releases the reference in the input index. Only the
+// references not yet written are held in memory.
+
+template<typename TTag>
+struct ReferenceSplit {
+    BamIndex<TTag> & inIndex;
+    BamIndex<TTag> outIndex;   // Empty except for the reference being written.
+    OutputWriter & writer;
+    ContigDictionary const & refNames;
+    SplitOptions const & options;
+    String<Pair<__uint32, __uint32> > binRanges;
+    std::ostringstream out;
+    size_t numWritten;         // The references before are written and released.
+    bool ok;
+
+    ReferenceSplit(BamIndex<TTag> & inIndex_, OutputWriter & writer_, ContigDictionary const & refNames_,
+                   SplitOptions const & options_) :
+        inIndex(inIndex_), writer(writer_), refNames(refNames_), options(options_),
+        out(std::ios::binary | std::ios::out), numWritten(0), ok(true)
+    {}
+
+    // Called by the index reader once the first numRefs references are complete.
+    void operator()(size_t numRefs)
+    {
+        splitReferences(*this, numRefs);
+    }
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Index files waiting to be chopped in watch mode, the regions shared by all bam
+// files and the accumulated statistics.
+
+struct WatchState {
+    WorkQueue queue;
+    std::mutex mutex;          // Guards the members below.
+    bool planReady;            // The regions are parsed.
+    ContigDictionary refNames;
+    RegionPlan plan;
+    ChopStats stats;
+    unsigned numChopped;
+    unsigned numFailed;
+
+    WatchState() : planReady(false), numChopped(0), numFailed(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// Index statistics of a reference or a window.
+
+struct IntervalProfile {
+    __uint64 numBins;          // Bins overlapping the interval, without the metabin.
+    __uint64 numChunks;        // Chunks in these bins.
+    __uint64 bytesSpanned;     // Compressed bytes a reader visits for the whole interval.
+    __uint64 indexBytes;       // Size of the index chopped for the interval.
+
+    IntervalProfile() :
+        numBins(0), numChunks(0), bytesSpanned(0), indexBytes(0)
+    {}
+};
+
+
+// -----------------------------------------------------------------------------
+
+// An input bam file in cohort mode.
+
+struct CohortSample {
+    CharString name;
+    CharString bamfile;
 };
 
 
@@ -50,14 +343,25 @@ void setupParser(ArgumentParser & parser, ChopBaiOptions & options)
 
     addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
     addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION-FILE\\fP");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fB-b\\fP \\fIBAM-LIST\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fB-w\\fP \\fIDIR\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
+    addUsageLine(parser, "\\fBprofile\\fP [\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP");
+    addUsageLine(parser, "\\fBview\\fP [\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
+    addUsageLine(parser, "\\fBsplit\\fP [\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP");
+    addUsageLine(parser, "\\fBcount\\fP [\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
 
     addDescription(parser, "Writes small index files for the specified regions based on an existing bai or csi file for "
                            "the input bamfile. The regions have to be specified in the formats \'chr:begin-end\', \'chr:begin\' and \'chr\' "
                            " where \'begin\' and \'end\' are 1-based and both endpoints are included. "
                            "The regions can be listed directly on the command line separated by spaces or in a file listing one region "
-                           "per line. The program writes a smaller index file for each region to the directory "
+                           "per line. Lines in BED format ('chr<TAB>begin<TAB>end', 0-based, end excluded) are also accepted in the "
+                           "file and named 'chr:begin-end' in 1-based coordinates. The program writes a smaller index file for each region to the directory "
                            "\'<output prefix>/<region>/<bamfile>.[bai|csi]\'. The output directories are created if "
-                           "they do not exist.");
+                           "they do not exist. The subcommand 'profile' reports the bin and chunk density of the index "
+                           "per reference and window; see 'chopBAI profile --help'. The subcommand 'view' reads the "
+                           "alignments of regions using a chopped index; see 'chopBAI view --help'. The subcommand 'split' writes "
+                           "one index per reference in a single pass over the index; see 'chopBAI split --help'. The subcommand 'count' "
+                           "estimates the number of reads of regions from the index alone; see 'chopBAI count --help'.");
 
     // Required arguments.
     addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM-FILE"));
@@ -68,11 +372,104 @@ void setupParser(ArgumentParser & parser, ChopBaiOptions & options)
     addOption(parser, ArgParseOption("p", "prefix", "Output prefix.", ArgParseArgument::STRING, "STR"));
     addOption(parser, ArgParseOption("l", "linear", "Include linear index of BAI in the output."));
     addOption(parser, ArgParseOption("s", "symlink", "Create a symbolic link to the bam file in the output directory."));
+    addOption(parser, ArgParseOption("f", "fan-out", "Distribute the region directories over a two-level directory layout "
+                                                     "'<output prefix>/XX/YY/<region>', where XXYY are the hexadecimal digits "
+                                                     "of a 16 bit FNV-1a hash of the region name."));
+    addOption(parser, ArgParseOption("O", "optimize", "Reduce each index to the smallest index that resolves all queries "
+                                                      "within the region to the same file ranges. Each optimized index is "
+                                                      "verified against the unoptimized one on sampled queries; the sizes "
+                                                      "before and after optimization are reported."));
+    addOption(parser, ArgParseOption("V", "verify", "Check each written index against the full index before writing it. "
+                                                    "Edge-case and random queries within the region must resolve to the "
+                                                    "same file ranges beyond the offset that the full index skips to. "
+                                                    "Regions that fail are reported and not written."));
+    addOption(parser, ArgParseOption("", "verify-queries", "Number of random queries per region with --verify.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("m", "mates", "Read the alignments of each region from the bam file and add the "
+                                                   "bins and chunks covering their mates outside the region, so that "
+                                                   "the index also finds the mates. Verification with --verify covers "
+                                                   "the region before the mates are added."));
+    addOption(parser, ArgParseOption("", "max-mate-windows", "Maximal number of windows of the smallest bins "
+                                                             "(16 kb) with mates added per region with --mates.", ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "max-mate-windows", "1");
+    addOption(parser, ArgParseOption("u", "unmapped", "Keep what readers need to seek to the unmapped reads at the end "
+                                                      "of the bam file in each index: the metabins with the file range "
+                                                      "and read counts of all references and the number of unaligned "
+                                                      "reads."));
+    addOption(parser, ArgParseOption("", "csi-min-shift", "Rebuild the index from the alignments of the bam file as CSI "
+                                                          "with bins of 2^INT positions on the deepest level, like "
+                                                          "'samtools index -c -m INT', and write CSI files for the "
+                                                          "regions. The compressed bytes that sampled queries within "
+                                                          "the regions span with the original and the rebuilt index "
+                                                          "are reported. Not available in cohort mode.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "csi-min-shift", "8");
+    setMaxValue(parser, "csi-min-shift", "20");
+    addOption(parser, ArgParseOption("", "csi-depth", "Number of levels of the bins of the rebuilt CSI.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "csi-depth", "1");
+    setMaxValue(parser, "csi-depth", "9");
+
+    addSection(parser, "Input options");
+    addOption(parser, ArgParseOption("c", "contigs", "Read the reference names from a .fai or .dict file instead of the "
+                                                     "bam header.", ArgParseArgument::INPUT_FILE, "FILE"));
+    setValidValues(parser, "contigs", "fai dict");
+    addOption(parser, ArgParseOption("b", "bam-list", "Cohort mode: BAM-FILE lists one bam file per line, optionally preceded "
+                                                      "by a sample name and a tab. The regions are parsed once and chopped from the "
+                                                      "index of each bam file. The output of each sample is written to "
+                                                      "'<output prefix>/<sample>', where the sample name defaults to the bam file "
+                                                      "name without '.bam'. All bam files must share the reference sequences."));
+    addOption(parser, ArgParseOption("w", "watch", "Watch mode: BAM-FILE is a directory that is watched for index files "
+                                                   "written or moved into it until the program is interrupted. Each "
+                                                   "index next to its bam file is chopped as in cohort mode once it is "
+                                                   "closed after writing. The regions are parsed once, using the "
+                                                   "reference names of the first bam file unless --contigs is given."));
+    addOption(parser, ArgParseOption("R", "rechop", "The index of BAM-FILE is a reduced index written by chopBAI, e.g. "
+                                                    "'<region>/<bamfile>.bai' with a symbolic link to the bam file. The "
+                                                    "regions must lie within the parent region that the index was chopped "
+                                                    "for, which is the name of the directory holding the index unless "
+                                                    "--parent is given. They are cropped from the reduced index without "
+                                                    "the original index. Keeping the unmapped reads needs a parent "
+                                                    "chopped with --unmapped. Not available in cohort and watch mode "
+                                                    "and with --mates."));
+    addOption(parser, ArgParseOption("P", "parent", "Parent region of the reduced index with --rechop.",
+                                     ArgParseArgument::STRING, "REGION"));
+    addOption(parser, ArgParseOption("n", "shards", "Split each region into INT shards holding about the same number of "
+                                                    "compressed bytes of the bam file, estimated from the chunks in the "
+                                                    "index. The shards are named 'chr:begin-end' and chopped instead of "
+                                                    "the regions. Not available in cohort mode.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "shards", "1");
+
+    addSection(parser, "Performance options");
+    addOption(parser, ArgParseOption("t", "threads", "Number of regions chopped in parallel, or number of bam files processed "
+                                                     "in parallel in cohort and watch mode. Each thread in these modes holds "
+                                                     "one index in memory.", ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "threads", "1");
+    addOption(parser, ArgParseOption("C", "index-cache", "Load the index from the cache file '<index>.chopcache' next to "
+                                                         "the index, which is memory mapped and only read for the "
+                                                         "references with regions. The cache is written if it is missing "
+                                                         "or older than the index."));
+    addOption(parser, ArgParseOption("", "io-uring", "Write the output files in batches of linked io_uring operations "
+                                                     "on Linux. Falls back to writing synchronously if io_uring is not "
+                                                     "available."));
 
     // Set default values.
     setDefaultValue(parser, "prefix", "current directory");
     setDefaultValue(parser, "linear", options.writeLinear?"true":"false");
     setDefaultValue(parser, "symlink", options.createSymlink?"true":"false");
+    setDefaultValue(parser, "fan-out", options.fanOut?"true":"false");
+    setDefaultValue(parser, "optimize", options.optimize?"true":"false");
+    setDefaultValue(parser, "verify", options.verify?"true":"false");
+    setDefaultValue(parser, "verify-queries", options.verifyQueries);
+    setDefaultValue(parser, "mates", options.addMates?"true":"false");
+    setDefaultValue(parser, "max-mate-windows", options.maxMateWindows);
+    setDefaultValue(parser, "unmapped", options.keepUnmapped?"true":"false");
+    setDefaultValue(parser, "csi-depth", "smallest covering the longest reference");
+    setDefaultValue(parser, "shards", options.numShards);
+    setDefaultValue(parser, "threads", options.numThreads);
+    setDefaultValue(parser, "index-cache", options.indexCache?"true":"false");
+    setDefaultValue(parser, "io-uring", options.ioUring?"true":"false");
 }
 
 
@@ -93,6 +490,45 @@ void getOptionValues(ChopBaiOptions & options, ArgumentParser & parser)
         options.writeLinear = true;
     if (isSet(parser, "symlink"))
         options.createSymlink = true;
+    if (isSet(parser, "fan-out"))
+        options.fanOut = true;
+    if (isSet(parser, "optimize"))
+        options.optimize = true;
+    if (isSet(parser, "verify"))
+        options.verify = true;
+    if (isSet(parser, "verify-queries"))
+        getOptionValue(options.verifyQueries, parser, "verify-queries");
+    if (isSet(parser, "mates"))
+        options.addMates = true;
+    if (isSet(parser, "max-mate-windows"))
+        getOptionValue(options.maxMateWindows, parser, "max-mate-windows");
+    if (isSet(parser, "unmapped"))
+        options.keepUnmapped = true;
+    if (isSet(parser, "csi-min-shift"))
+        getOptionValue(options.csiMinShift, parser, "csi-min-shift");
+    if (isSet(parser, "csi-depth"))
+        getOptionValue(options.csiDepth, parser, "csi-depth");
+    if (isSet(parser, "contigs"))
+        getOptionValue(options.contigsFile, parser, "contigs");
+    if (isSet(parser, "bam-list"))
+        options.bamList = true;
+    if (isSet(parser, "watch"))
+        options.watchDir = true;
+    if (isSet(parser, "rechop"))
+        options.rechop = true;
+    if (isSet(parser, "parent"))
+    {
+        getOptionValue(options.parentRegion, parser, "parent");
+        options.rechop = true;
+    }
+    if (isSet(parser, "shards"))
+        getOptionValue(options.numShards, parser, "shards");
+    if (isSet(parser, "threads"))
+        getOptionValue(options.numThreads, parser, "threads");
+    if (isSet(parser, "index-cache"))
+        options.indexCache = true;
+    if (isSet(parser, "io-uring"))
+        options.ioUring = true;
 }
 
 
@@ -117,74 +553,11 @@ ArgumentParser::ParseResult parseCommandLine(ChopBaiOptions & options, int argc,
     return res;
 }
 
-template<typename T>
-bool parseDecimals(T &x, const CharString &s) {
-  // if it's easy, just cast
-  if (lexicalCast(x, s)) {
-      return true;
-  }
-
-  T val(0);
-  int n = length(s);
-  int lastcomma = -1;
-  int i = 0;
-  char c;
-  while (i <= n) {
-    if (i==n) {
-      c=',';
-    } else {
-      c=s[i];
-    }
-    if (!isdigit(c)) {
-      if (c == ',') {
-        if ((i - lastcomma) == 4 || (lastcomma == -1 && i < 4)) {
-          T t(0);
-          if (!lexicalCast(t,infix(s,lastcomma+1,i))) {
-            return false;
-          }
-          val *= 1000;
-          val += t;
-          lastcomma = i;
-        } else {
-          return false; // too many digits between commas
-        }
-      } else {
-        return false; // not a digit or comma
-      }
-    }
-    i++;
-  }
-
-  x = val;
-  return true;
-}
-
-
-// -----------------------------------------------------------------------------
-// Function readRegions()
-// -----------------------------------------------------------------------------
-
-bool readRegions(String<CharString> & regions, CharString const & regionsFile)
-{
-    std::ifstream stream(toCString(regionsFile));
-    if (!stream.is_open())
-    {
-        std::cerr << "ERROR: Could not open file listing the regions: " << regionsFile << std::endl;
-        return 1;
-    }
-
-    std::string region;
-    while (getline(stream, region))
-        appendValue(regions, region);
-
-    return 0;
-}
-
 // -----------------------------------------------------------------------------
 // Function fileExists()
 // -----------------------------------------------------------------------------
 
-bool fileExists(CharString & filename)
+bool fileExists(CharString const & filename)
 {
     FILE *file = fopen(toCString(filename), "r");
     if (file != NULL)
@@ -200,7 +573,7 @@ bool fileExists(CharString & filename)
 // Function findIndexFile()
 // -----------------------------------------------------------------------------
 
-bool findIndexFile(CharString & indexfile, CharString & bamfile)
+bool findIndexFile(CharString & indexfile, CharString const & bamfile)
 {
     // Check if BAI file exists: Given FILE.bam, first look for FILE.bam.bai and then for FILE.bai
     indexfile = bamfile;
@@ -239,470 +612,3122 @@ bool findIndexFile(CharString & indexfile, CharString & bamfile)
 }
 
 // -----------------------------------------------------------------------------
-// Function parseInterval()
+// Function addContig()
 // -----------------------------------------------------------------------------
 
-bool parseInterval(GenomicInterval & interval, CharString & region, NameStoreCache<StringSet<CharString> > & refNames)
+void addContig(ContigDictionary & contigs, CharString const & name, __uint32 len)
 {
-    typedef Iterator<CharString, Rooted>::Type TIter;
+    contigs.ids[toCString(name)] = length(contigs.names);
+    appendValue(contigs.names, name);
+    appendValue(contigs.lengths, len);
+}
 
-    // first check if region names a chromosome
-    if (getIdByName(interval.chrId, refNames, region))
-    {
-      interval.begin = 0;
-      interval.end = MaxValue<__uint32>::VALUE;
-      return 0;
-    }
-    // otherwise, we need to parse the name
+// -----------------------------------------------------------------------------
+// Function getContigId()
+// -----------------------------------------------------------------------------
 
-    // Read the chromosome name.
-    CharString chrName;
-    TIter it = begin(region);
-    TIter itEnd = end(region);
-    goEnd(it);
-    bool hasColon = false;
-    while(!atBegin(it))
-    {
-        goPrevious(it);
-        if (*it == ':')
-        {
-            hasColon = true;
-            chrName = prefix(region, position(it));
-            break;
-        }
-    }
+bool getContigId(size_t & id, ContigDictionary const & contigs, std::string const & name)
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = contigs.ids.find(name);
+    if (it == contigs.ids.end())
+        return false;
+    id = it->second;
+    return true;
+}
 
-    if (hasColon)
-    {
-        // check if the chromosome itself has a colon but is listed
-        if (!getIdByName(interval.chrId, refNames, chrName))
-        {
-            std::cerr << "WARNING: " << chrName << " does not specify a valid segment " << std::endl;
-            return 1;
-        }
-    } else {
-        return 1;
-    }
+// -----------------------------------------------------------------------------
+// Function headerContigs()
+// -----------------------------------------------------------------------------
 
-    // Read the begin and end position.
-    ++it;
-    size_t infixBeg = position(it);
-    bool hasDash = false;
-    for (; it != itEnd; ++it)
-    {
-        if (*it == '-')
-        {
-            hasDash = true;
-            if (!parseDecimals(interval.begin, CharString(infix(region, infixBeg, position(it))))) return 1;
-            if (!parseDecimals(interval.end, CharString(suffix(region, position(it) + 1)))) return 1;
-            if (interval.begin != 0) --interval.begin;
-            return 0;
-        }
-    }
+// Adds the references of a bam header read and checked by readHeader().
 
-    if (!hasDash)
+void headerContigs(ContigDictionary & contigs, String<char> const & header)
+{
+    __int32 lText = 0;
+    memcpy(&lText, &header[4], 4);
+    size_t pos = 8 + lText;
+    __int32 nRef = 0;
+    memcpy(&nRef, &header[pos], 4);
+    pos += 4;
+
+    reserve(contigs.names, nRef, Exact());
+    reserve(contigs.lengths, nRef, Exact());
+    contigs.ids.reserve(nRef);
+
+    CharString name;
+    for (__int32 i = 0; i < nRef; ++i)
     {
-        if (!parseDecimals(interval.begin, CharString(infix(region,infixBeg, position(itEnd))))) return 1;
-        if (interval.begin != 0) --interval.begin;
-        interval.end = MaxValue<__uint32>::VALUE;
-        return 0;
+        __int32 lName = 0;
+        memcpy(&lName, &header[pos], 4);
+        name = infix(header, pos + 4, pos + 4 + lName - 1);  // Without the terminating NUL character.
+        __uint32 lRef = 0;
+        memcpy(&lRef, &header[pos + 4 + lName], 4);
+        pos += 8 + lName;
+
+        addContig(contigs, name, lRef);
     }
-
-
-    return 1;
 }
 
-
 // -----------------------------------------------------------------------------
-// Function parseIntervals()
+// Function readBamContigs()
 // -----------------------------------------------------------------------------
 
-bool parseIntervals(String<GenomicInterval> & intervals, String<CharString> & regions, CharString & bamfile)
-{
-    typedef NameStoreCache<StringSet<CharString> > TNamesCache;
+// Decodes only the binary reference dictionary at the start of the bam file.
+// The header text is skipped without being parsed.
 
-    // Convert chromosome name into chrId using the header of bamfile.
-    BamFileIn bamFileIn;
-    if (!open(bamFileIn, toCString(bamfile)))
+int readBamContigs(ContigDictionary & contigs, CharString const & bamfile)
+{
+    RegionReader reader;
+    if (!open(reader, toCString(bamfile), 1, 0))
     {
         std::cerr << "ERROR: Could not open " << bamfile << std::endl;
         return 1;
     }
-    BamHeader header;
-    readHeader(header, bamFileIn);
-    TNamesCache refNames = contigNamesCache(context(bamFileIn));
-
-    if (length(regions) == 1)
-    {
-        // Check if it is a single region.
-        GenomicInterval interval;
-        if (parseInterval(interval, regions[0], refNames) == 0)
-        {
-            appendValue(intervals, interval);
-            return 0;
-        }
-
-        // Read file listing the regions.
-        CharString regionsFile = regions[0];
-        clear(regions);
-        readRegions(regions, regionsFile);
-    }
 
-    for(size_t i = 0; i < length(regions); ++i)
+    String<char> header;
+    if (!readHeader(header, reader))
     {
-        GenomicInterval interval;
-        if (parseInterval(interval, regions[i], refNames) != 0)
-        {
-            std::cerr << "ERROR: Could not parse region " << i << ": " << regions[i] << std::endl;
-            std::cerr << "       Please specify region in format chr:beg-end." << std::endl;
-            return 1;
-        }
-        appendValue(intervals, interval);
+        if (length(header) < 4 || strncmp(&header[0], "BAM\1", 4) != 0)
+            std::cerr << "ERROR: " << bamfile << " is not a bam file." << std::endl;
+        else
+            std::cerr << "ERROR: Could not read the header of " << bamfile << std::endl;
+        return 1;
     }
 
+    headerContigs(contigs, header);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
-// Function cropInterval()
+// Function readContigsFile()
 // -----------------------------------------------------------------------------
 
-void cropInterval(BamIndex<Csi> & outcsi, BamIndex<Csi> & incsi, GenomicInterval & interval, bool )
-{
-    // Initialize the output bam index
-    outcsi._minShift = incsi._minShift;
-    outcsi._depth = incsi._depth;
-    __int32 nRef = length(incsi._binIndices);
-    resize(outcsi._binIndices, nRef);
+// Reads the reference names and lengths from a .fai file (NAME<tab>LENGTH...) or
+// from a .dict file (@SQ<tab>SN:NAME<tab>LN:LENGTH...). The order of names must
+// match the order of references in the bam header; the number of names is checked
+// against the index and the regions against the given lengths.
 
-    // --- Crop the region from the bin index ---
+int readContigsFile(ContigDictionary & contigs, CharString const & contigsFile)
+{
+    std::ifstream stream(toCString(contigsFile));
+    if (!stream.is_open())
+    {
+        std::cerr << "ERROR: Could not open file listing the contigs: " << contigsFile << std::endl;
+        return 1;
+    }
 
-    String<__uint32> candidateBins;
-    _csiReg2bins(candidateBins, interval.begin, interval.end, incsi._minShift, incsi._depth);
+    bool isDict = length(contigsFile) >= 5 && suffix(contigsFile, length(contigsFile) - 5) == ".dict";
 
-    typedef Iterator<String<__uint32>, Rooted>::Type TCandidateIter;
-    for (TCandidateIter it = begin(candidateBins, Rooted()); !atEnd(it); ++it)
+    std::string line;
+    while (getline(stream, line))
     {
-        typedef std::map<__uint32, CsiBamIndexBinData_>::const_iterator TMapIter;
-        TMapIter mIt = incsi._binIndices[interval.chrId].find(*it);
-        if (mIt == incsi._binIndices[interval.chrId].end())
-            continue;  // Candidate is not in index!
+        std::string name;
+        __uint32 len = 0;
 
-        // TODO: What about chunks.loffset?
-        CsiBamIndexBinData_ chunks;
-        typedef Iterator<String<Pair<__uint64, __uint64> > const, Rooted>::Type TBegEndIter;
-        for (TBegEndIter it2 = begin(mIt->second.chunkBegEnds, Rooted()); !atEnd(it2); goNext(it2))
-            appendValue(chunks.chunkBegEnds, *it2);
+        if (isDict)
+        {
+            if (line.compare(0, 4, "@SQ\t") != 0)
+                continue;
+            size_t pos = 3;
+            while (pos < line.size())
+            {
+                size_t next = line.find('\t', pos + 1);
+                if (next == std::string::npos)
+                    next = line.size();
+                if (line.compare(pos + 1, 3, "SN:") == 0)
+                    name = line.substr(pos + 4, next - pos - 4);
+                else if (line.compare(pos + 1, 3, "LN:") == 0)
+                    len = strtoul(line.c_str() + pos + 4, NULL, 10);
+                pos = next;
+            }
+        }
+        else
+        {
+            size_t tab = line.find('\t');
+            name = line.substr(0, tab);
+            if (tab != std::string::npos)
+                len = strtoul(line.c_str() + tab + 1, NULL, 10);
+        }
 
-        if (length(chunks.chunkBegEnds) > 0)
-            outcsi._binIndices[interval.chrId][*it] = chunks;
+        if (name.empty())
+            continue;
+        addContig(contigs, CharString(name), len);
     }
+    contigs.checkLengths = true;
 
-    // TODO: Copy the metabin if whole chromosome is cropped.
+    return 0;
 }
 
+// -----------------------------------------------------------------------------
+// Function readContigs()
 // -----------------------------------------------------------------------------
 
-void cropInterval(BamIndex<Bai> & outbai, BamIndex<Bai> & inbai, GenomicInterval & interval, bool writeLinear)
+int readContigs(ContigDictionary & contigs, CharString const & contigsFile, CharString const & bamfile)
 {
-    // Initialize the output bam index
-    __int32 nRef = length(inbai._linearIndices);
-    resize(outbai._linearIndices, nRef);
-    resize(outbai._binIndices, nRef);
+    if (!empty(contigsFile))
+        return readContigsFile(contigs, contigsFile);
+    return readBamContigs(contigs, bamfile);
+}
 
-    // --- Crop the region from the linear index ---
+// -----------------------------------------------------------------------------
+// Function parseDecimals()
+// -----------------------------------------------------------------------------
 
-    unsigned windowIdx = interval.begin >> 14;  // Linear index consists of 16kb windows.
-    unsigned windowEndIdx = (interval.end >> 14) + 1;
+// Parses the decimal number in [it, itEnd) which may contain commas separating
+// groups of three digits, e.g. '1,000,000'.
 
-    __uint64 linearMinOffset = 0;
+template<typename T>
+bool parseDecimals(T & x, char const * it, char const * itEnd)
+{
+    __uint64 val = 0;
+    unsigned digits = 0;  // Number of digits since the last comma.
+    bool hasComma = false;
 
-    if (windowIdx < length(inbai._linearIndices[interval.chrId]))
+    for (; it != itEnd; ++it)
     {
-        linearMinOffset = inbai._linearIndices[interval.chrId][windowIdx];
-
-        __uint64 minOffset = 0u;
-        for (unsigned i = interval.chrId; i < length(inbai._linearIndices); ++i)
+        if (isdigit(*it))
         {
-            if (!empty(inbai._linearIndices[i]))
-            {
-                minOffset = front(inbai._linearIndices[i]);
-                break;
-            }
-        }
-
-        // Crop the linear index if user asked for it.
-        if (writeLinear)
-        {
-            for (unsigned i = 0; i < windowIdx; ++i)
-                appendValue(outbai._linearIndices[interval.chrId], minOffset);
-            for (unsigned i = windowIdx; i < _min(windowEndIdx, length(inbai._linearIndices[interval.chrId])); ++i)
-                appendValue(outbai._linearIndices[interval.chrId], inbai._linearIndices[interval.chrId][i]);
+            val = val * 10 + (*it - '0');
+            if (val > MaxValue<T>::VALUE)
+                return false;  // overflow
+            ++digits;
         }
-    }
-    else  // set linearMinOffset to next non-zero entry in linear indices
-    {
-        if (empty(inbai._linearIndices[interval.chrId]))
+        else if (*it == ',')
         {
-            for (unsigned i = interval.chrId; i < length(inbai._linearIndices); ++i)
-            {
-                if (!empty(inbai._linearIndices[i]))
-                {
-                    linearMinOffset = front(inbai._linearIndices[i]);
-                    if (linearMinOffset != 0u)
-                        break;
-                    for (unsigned j = 1; j < length(inbai._linearIndices[i]); ++j)
-                    {
-                        if (inbai._linearIndices[i][j] != 0u)
-                        {
-                            linearMinOffset = inbai._linearIndices[i][j];
-                            break;
-                        }
-                    }
-                    if (linearMinOffset != 0u)
-                        break;
-                }
-            }
+            if (digits == 0 || digits > 3 || (hasComma && digits != 3))
+                return false;  // wrong number of digits between commas
+            hasComma = true;
+            digits = 0;
         }
         else
         {
-            linearMinOffset = back(inbai._linearIndices[interval.chrId]);
+            return false;  // not a digit or comma
         }
     }
 
-    // --- Crop the region from the bin index ---
-
-    String<__uint16> candidateBins;
-    _baiReg2bins(candidateBins, interval.begin, interval.end);
-
-    typedef Iterator<String<__uint16>, Rooted>::Type TCandidateIter;
-    for (TCandidateIter it = begin(candidateBins, Rooted()); !atEnd(it); ++it)
-    {
-        typedef std::map<__uint32, BaiBamIndexBinData_>::const_iterator TMapIter;
-        TMapIter mIt = inbai._binIndices[interval.chrId].find(*it);
-        if (mIt == inbai._binIndices[interval.chrId].end())
-            continue;  // Candidate is not in index!
-
-        BaiBamIndexBinData_ chunks;
-        typedef Iterator<String<Pair<__uint64, __uint64> > const, Rooted>::Type TBegEndIter;
-        for (TBegEndIter it2 = begin(mIt->second.chunkBegEnds, Rooted()); !atEnd(it2); goNext(it2))
-            if (it2->i2 >= linearMinOffset)
-                appendValue(chunks.chunkBegEnds, *it2);
+    if (digits == 0 || (hasComma && digits != 3))
+        return false;
 
-        if (length(chunks.chunkBegEnds) > 0)
-            outbai._binIndices[interval.chrId][*it] = chunks;
-    }
-
-	// Copy the metabin (magic bin number 37450) if whole chromosome is cropped.
-	if (interval.begin == 0 && interval.end == MaxValue<__uint32>::VALUE)
-		outbai._binIndices[interval.chrId][37450] = inbai._binIndices[interval.chrId].find(37450)->second;
+    x = val;
+    return true;
 }
 
-
 // -----------------------------------------------------------------------------
-// Function printBamIndex()                              // only for debugging
+// Function parseRegion()
 // -----------------------------------------------------------------------------
 
-void printBamIndex(BamIndex<Csi> & csi)
+// Parses a region in [it, itEnd) given as 'chr', 'chr:begin' or 'chr:begin-end'
+// (1-based, both endpoints included). The string name is a reusable buffer.
+
+bool parseRegion(GenomicInterval & interval, char const * it, char const * itEnd,
+                 ContigDictionary const & contigs, std::string & name)
 {
-    std::cout << "Number of bits for the minimal interval: " << csi._minShift << std::endl;
-    std::cout << "Depth of the binning index: " << csi._depth << std::endl;
+    // first check if region names a chromosome
+    name.assign(it, itEnd);
+    if (getContigId(interval.chrId, contigs, name))
+    {
+        interval.begin = 0;
+        interval.end = MaxValue<__uint32>::VALUE;
+        return 0;
+    }
+    // otherwise, we need to parse the name
+
+    // Read the chromosome name up to the last colon.
+    char const * colon = itEnd;
+    while (colon != it && *(colon - 1) != ':')
+        --colon;
+    if (colon == it)
+        return 1;
+
+    // check if the chromosome itself has a colon but is listed
+    name.assign(it, colon - 1);
+    if (!getContigId(interval.chrId, contigs, name))
+    {
+        std::cerr << "WARNING: " << name << " does not specify a valid segment " << std::endl;
+        return 1;
+    }
+
+    // Read the begin and end position.
+    char const * dash = std::find(colon, itEnd, '-');
+    if (!parseDecimals(interval.begin, colon, dash))
+        return 1;
+    if (interval.begin != 0)
+        --interval.begin;
+
+    interval.end = MaxValue<__uint32>::VALUE;
+    if (dash != itEnd && !parseDecimals(interval.end, dash + 1, itEnd))
+        return 1;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function parseBedLine()
+// -----------------------------------------------------------------------------
+
+// Parses a BED line 'chr<TAB>begin<TAB>end[<TAB>...]' in [it, itEnd) (0-based,
+// half-open) and writes the region in the format 'chr:begin-end' to label.
+
+bool parseBedLine(GenomicInterval & interval, char const * it, char const * itEnd,
+                  ContigDictionary const & contigs, std::string & name, std::string & label)
+{
+    char const * tab1 = std::find(it, itEnd, '\t');
+    if (tab1 == itEnd)
+        return 1;
+    char const * tab2 = std::find(tab1 + 1, itEnd, '\t');
+    if (tab2 == itEnd)
+        return 1;
+    char const * tab3 = std::find(tab2 + 1, itEnd, '\t');
+
+    name.assign(it, tab1);
+    if (!getContigId(interval.chrId, contigs, name))
+    {
+        std::cerr << "WARNING: " << name << " does not specify a valid segment " << std::endl;
+        return 1;
+    }
+
+    if (!parseDecimals(interval.begin, tab1 + 1, tab2) || !parseDecimals(interval.end, tab2 + 1, tab3))
+        return 1;
+    if (interval.begin >= interval.end)
+        return 1;
+
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), ":%u-%u", interval.begin + 1, interval.end);
+    label.assign(name);
+    label.append(buffer, len);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function readRegions()
+// -----------------------------------------------------------------------------
+
+// Reads a file listing one region per line, either in the format 'chr:begin-end'
+// or as BED. The file is memory mapped and parsed in place; empty lines, comment
+// lines and BED track and browser lines are skipped.
+
+bool readRegions(String<GenomicInterval> & intervals, TRegionNames & regionNames,
+                 CharString const & regionsFile, ContigDictionary const & contigs)
+{
+    String<char, MMap<> > file;
+    if (!open(file, toCString(regionsFile), OPEN_RDONLY))
+    {
+        std::cerr << "ERROR: Could not open file listing the regions: " << regionsFile << std::endl;
+        return 1;
+    }
+
+    char const * it = begin(file, Standard());
+    char const * itEnd = end(file, Standard());
+
+    size_t numLines = std::count(it, itEnd, '\n') + 1;
+    reserve(intervals, length(intervals) + numLines, Exact());
+    reserve(regionNames.limits, length(regionNames.limits) + numLines, Exact());
+    reserve(regionNames.concat, length(regionNames.concat) + (itEnd - it), Exact());
+
+    std::string name;
+    std::string label;
+    GenomicInterval interval;
+    for (size_t lineNo = 1; it != itEnd; ++lineNo)
+    {
+        char const * lineEnd = std::find(it, itEnd, '\n');
+        char const * lineBack = lineEnd;
+        if (lineBack != it && *(lineBack - 1) == '\r')
+            --lineBack;
+
+        bool skip = it == lineBack || *it == '#' ||
+                    (lineBack - it >= 5 && strncmp(it, "track", 5) == 0) ||
+                    (lineBack - it >= 7 && strncmp(it, "browser", 7) == 0);
+        if (!skip)
+        {
+            bool isBed = std::find(it, lineBack, '\t') != lineBack;
+            bool failed = isBed ? parseBedLine(interval, it, lineBack, contigs, name, label)
+                                : parseRegion(interval, it, lineBack, contigs, name);
+            if (failed)
+            {
+                std::cerr << "ERROR: Could not parse line " << lineNo << " of " << regionsFile << ": "
+                          << std::string(it, lineBack) << std::endl;
+                std::cerr << "       Please specify region in format chr:beg-end or as BED." << std::endl;
+                return 1;
+            }
+            if (!isBed)
+                label.assign(it, lineBack);
+
+            appendValue(intervals, interval);
+            appendValue(regionNames, label);
+        }
+
+        it = (lineEnd == itEnd) ? itEnd : lineEnd + 1;
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function checkRegionEnds()
+// -----------------------------------------------------------------------------
+
+// Checks that the regions end within the reference lengths given in a contigs
+// file. A region passing the end hints at a file of another assembly.
+
+bool checkRegionEnds(RegionPlan const & plan, ContigDictionary const & refNames)
+{
+    if (!refNames.checkLengths)
+        return 0;
+
+    for (unsigned i = 0; i < length(plan.intervals); ++i)
+    {
+        GenomicInterval const & interval = plan.intervals[i];
+        __uint32 refLength = refNames.lengths[interval.chrId];
+        if (refLength != 0 && interval.end != MaxValue<__uint32>::VALUE && interval.end > refLength)
+        {
+            std::cerr << "ERROR: Region " << plan.regionNames[i] << " ends behind " << refNames.names[interval.chrId]
+                      << ", which has length " << refLength << " in the contigs file." << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function parseIntervals()
+// -----------------------------------------------------------------------------
+
+bool parseIntervals(RegionPlan & plan, String<CharString> const & regions, ContigDictionary const & refNames)
+{
+    plan.numRefs = length(refNames.names);
+
+    std::string name;
+    if (length(regions) == 1)
+    {
+        // Check if it is a single region.
+        GenomicInterval interval;
+        if (parseRegion(interval, begin(regions[0], Standard()), end(regions[0], Standard()), refNames, name) == 0)
+        {
+            appendValue(plan.intervals, interval);
+            appendValue(plan.regionNames, regions[0]);
+            return checkRegionEnds(plan, refNames);
+        }
+
+        // Read file listing the regions.
+        if (readRegions(plan.intervals, plan.regionNames, regions[0], refNames) != 0)
+            return 1;
+        return checkRegionEnds(plan, refNames);
+    }
+
+    for(size_t i = 0; i < length(regions); ++i)
+    {
+        GenomicInterval interval;
+        if (parseRegion(interval, begin(regions[i], Standard()), end(regions[i], Standard()), refNames, name) != 0)
+        {
+            std::cerr << "ERROR: Could not parse region " << i << ": " << regions[i] << std::endl;
+            std::cerr << "       Please specify region in format chr:beg-end." << std::endl;
+            return 1;
+        }
+        appendValue(plan.intervals, interval);
+        appendValue(plan.regionNames, regions[i]);
+    }
+
+    return checkRegionEnds(plan, refNames);
+}
+
+// -----------------------------------------------------------------------------
+// Function checkParentRegion()
+// -----------------------------------------------------------------------------
+
+// Checks that the regions lie within the parent region of a reduced index. A
+// reduced index resolves queries within its parent region like the full index,
+// so that regions within it can be cropped from it. The parent region defaults
+// to the name of the directory holding the index, as written by chopBAI.
+
+bool checkParentRegion(RegionPlan const & plan, ContigDictionary const & refNames, CharString const & indexfile,
+                       CharString const & parentRegion)
+{
+    std::string parent = toCString(parentRegion);
+    if (parent.empty())
+    {
+        std::string dir = toCString(indexfile);
+        size_t slash = dir.rfind('/');
+        if (slash == std::string::npos)
+        {
+            char buf[10240];
+            if (getcwd(buf, 10240) == 0)
+            {
+                std::cerr << "ERROR: Could not determine the current working directory." << std::endl;
+                return 1;
+            }
+            dir = buf;
+        }
+        else
+        {
+            dir.resize(slash);
+        }
+        slash = dir.rfind('/');
+        parent = (slash == std::string::npos) ? dir : dir.substr(slash + 1);
+    }
+
+    GenomicInterval parentInterval;
+    std::string name;
+    if (parseRegion(parentInterval, parent.c_str(), parent.c_str() + parent.size(), refNames, name) != 0)
+    {
+        std::cerr << "ERROR: Could not parse the parent region " << parent << " of the reduced index " << indexfile
+                  << ". Please specify it with --parent." << std::endl;
+        return 1;
+    }
+
+    bool failed = false;
+    for (unsigned i = 0; i < length(plan.intervals); ++i)
+    {
+        GenomicInterval const & interval = plan.intervals[i];
+        if (interval.chrId != parentInterval.chrId || interval.begin < parentInterval.begin ||
+            interval.end > parentInterval.end)
+        {
+            std::cerr << "ERROR: Region " << plan.regionNames[i] << " is not within the parent region " << parent
+                      << " of the reduced index." << std::endl;
+            failed = true;
+        }
+    }
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// Function cropUnmapped()
+// -----------------------------------------------------------------------------
+
+// Copies what readers need to seek to the unmapped reads behind the alignments of
+// the last reference: the metabins of all references and the number of unaligned
+// reads.
+
+template<typename TTag>
+void cropUnmapped(BamIndex<TTag> & outIndex, BamIndex<TTag> const & inIndex)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_::const_iterator TMapIter;
+
+    for (unsigned i = 0; i < length(inIndex._binIndices); ++i)
+    {
+        TMapIter mIt = inIndex._binIndices[i].find(metaBin(inIndex));
+        if (mIt != inIndex._binIndices[i].end())
+            outIndex._binIndices[i][mIt->first] = mIt->second;
+    }
+
+    outIndex._unalignedCount = inIndex._unalignedCount;
+}
+
+// -----------------------------------------------------------------------------
+// Function collectMates()
+// -----------------------------------------------------------------------------
+
+// Collects the windows of minimal size holding the mates of the alignments that
+// overlap the interval, except for mates within the interval. At most maxWindows
+// windows are collected. Returns false if the bam file cannot be read.
+
+template<typename TTag>
+bool collectMates(MateScan & mates, BamIndex<TTag> const & index, GenomicInterval const & interval,
+                  unsigned maxWindows)
+{
+    mates.windows.clear();
+    mates.capped = false;
+
+    try
+    {
+        if (!mates.isOpen)
+        {
+            if (!open(mates.bamFile, toCString(mates.bamfile)))
+                return false;
+            BamHeader header;
+            readHeader(header, mates.bamFile);
+            mates.isOpen = true;
+        }
+
+        __int32 chrId = interval.chrId;
+        __int64 end = _min((__int64)interval.end, (__int64)MaxValue<__int32>::VALUE);
+        bool hasAlignments = false;
+        if (!jumpToRegion(mates.bamFile, hasAlignments, chrId, interval.begin, end, index))
+            return false;
+        if (!hasAlignments)
+            return true;
+
+        unsigned shift = binningMinShift(index);
+        BamAlignmentRecord & record = mates.record;
+        while (!atEnd(mates.bamFile))
+        {
+            readRecord(record, mates.bamFile);
+            if (record.rID != chrId || record.beginPos >= end)
+                break;
+            if ((__int64)record.beginPos + getAlignmentLengthInRef(record) <= (__int64)interval.begin)
+                continue;
+            if (!hasFlagMultiple(record) || hasFlagNextUnmapped(record) ||
+                record.rNextId == BamAlignmentRecord::INVALID_REFID || record.pNext < 0)
+                continue;
+            if (record.rNextId == chrId && (__uint32)record.pNext >= interval.begin && record.pNext < end)
+                continue;  // The region's own bins find the mate.
+
+            std::pair<__int32, __uint32> window(record.rNextId, (__uint32)record.pNext >> shift);
+            if (mates.windows.size() < maxWindows)
+                mates.windows.insert(window);
+            else if (mates.windows.count(window) == 0)
+                mates.capped = true;
+        }
+    }
+    catch (std::exception const & e)
+    {
+        SEQAN_OMP_PRAGMA(critical (cerr))
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function addMates()
+// -----------------------------------------------------------------------------
+
+// Adds to index the bins and chunks of the full index that a query of each mate
+// window uses, without the chunks that end before the query's minimal offset.
+
+template<typename TTag>
+void addMates(BamIndex<TTag> & index, BamIndex<TTag> const & fullIndex, MateScan const & mates,
+              String<Pair<__uint32, __uint32> > & binRanges)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator  TMapIter;
+    typedef typename TBinIndex::iterator        TOutIter;
+
+    unsigned shift = binningMinShift(fullIndex);
+    std::set<std::pair<__int32, __uint32> >::const_iterator it;
+    for (it = mates.windows.begin(); it != mates.windows.end(); ++it)
+    {
+        if (it->first < 0 || (unsigned)it->first >= length(fullIndex._binIndices))
+            continue;
+
+        TBinIndex const & binIndex = fullIndex._binIndices[it->first];
+        TBinIndex & outBinIndex = index._binIndices[it->first];
+        __uint64 beg = (__uint64)it->second << shift;
+        __uint64 minOffset = queryMinOffset(fullIndex, it->first, beg);
+
+        getCandidateBinRanges(binRanges, beg, beg + (1u << shift), fullIndex);
+        for (unsigned i = 0; i < length(binRanges); ++i)
+        {
+            TMapIter mIt = binIndex.lower_bound(binRanges[i].i1);
+            if (mIt == binIndex.end() || mIt->first > binRanges[i].i2)
+                continue;  // A window has one candidate bin per level.
+
+            // Copy the bin without chunks, which keeps the loffset of CSI bins.
+            TOutIter outIt = outBinIndex.find(mIt->first);
+            bool inserted = (outIt == outBinIndex.end());
+            if (inserted)
+            {
+                outIt = outBinIndex.insert(*mIt).first;
+                clear(outIt->second.chunkBegEnds);
+            }
+
+            String<Pair<__uint64, __uint64> > & chunks = outIt->second.chunkBegEnds;
+            for (unsigned j = 0; j < length(mIt->second.chunkBegEnds); ++j)
+                if (mIt->second.chunkBegEnds[j].i2 > minOffset)
+                    appendValue(chunks, mIt->second.chunkBegEnds[j]);
+            mergeChunks(chunks);
+            if (inserted && empty(chunks))
+                outBinIndex.erase(outIt);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Function regionMinOffset()
+// -----------------------------------------------------------------------------
+
+// Returns the smallest file offset that the full index lets a reader skip to for
+// a query within the interval.
+
+__uint64 regionMinOffset(BamIndex<Bai> const & index, GenomicInterval const & interval)
+{
+    // The linear index is non-decreasing, the minimum is at the begin of the interval.
+    return queryMinOffset(index, interval.chrId, interval.begin);
+}
+
+// -----------------------------------------------------------------------------
+
+__uint64 regionMinOffset(BamIndex<Csi> const & index, GenomicInterval const & interval)
+{
+    unsigned shift = index._minShift;
+    __uint64 end = _min((__uint64)interval.end, (__uint64)1 << (shift + 3 * index._depth));
+
+    __uint64 minOffset = queryMinOffset(index, interval.chrId, interval.begin);
+    for (__uint64 pos = ((interval.begin >> shift) + 1) << shift; pos < end; pos += (__uint64)1 << shift)
+        minOffset = _min(minOffset, queryMinOffset(index, interval.chrId, pos));
+    return minOffset;
+}
+
+// -----------------------------------------------------------------------------
+// Function binLastWindow()
+// -----------------------------------------------------------------------------
+
+// Returns the last window of minimal size covered by a bin of a binning index
+// with the given depth.
+
+__uint64 binLastWindow(__uint32 bin, int depth)
+{
+    __int32 level = binLevel(bin, depth);
+    return (((__uint64)(bin - levelFirstBin(level)) + 1) << (3 * (depth - level))) - 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function optimizeBins()
+// -----------------------------------------------------------------------------
+
+// Removes from the bins all file ranges that no query within the interval needs:
+// parts of chunks before minOffset, and parts covered by chunks of an ancestor
+// bin, since every query using a bin also uses its ancestors. The chunks of each
+// bin are merged. Bins left without chunks are removed unless keepEmpty is set.
+
+template <typename TBinIndex>
+void optimizeBins(TBinIndex & binIndex, __uint64 minOffset, __uint32 metaBin, bool keepEmpty)
+{
+    typedef String<Pair<__uint64, __uint64> > TChunks;
+    typedef typename TBinIndex::iterator      TBinIter;
+
+    // Union of the chunks of each bin and its ancestors. Ancestors have smaller
+    // bin numbers, so they are visited first.
+    std::map<__uint32, TChunks> covered;
+
+    for (TBinIter it = binIndex.begin(); it != binIndex.end(); )
+    {
+        if (it->first >= metaBin)
+        {
+            ++it;
+            continue;
+        }
+
+        // Clip the chunks at minOffset.
+        TChunks & chunks = it->second.chunkBegEnds;
+        size_t k = 0;
+        for (size_t i = 0; i < length(chunks); ++i)
+        {
+            if (chunks[i].i2 <= minOffset)
+                continue;
+            chunks[k].i1 = _max(chunks[i].i1, minOffset);
+            chunks[k].i2 = chunks[i].i2;
+            ++k;
+        }
+        resize(chunks, k);
+        mergeChunks(chunks);
+
+        // Find the closest ancestor in the index.
+        std::map<__uint32, TChunks>::const_iterator ancestor = covered.end();
+        for (__uint32 bin = it->first; bin > 0u && ancestor == covered.end(); )
+        {
+            bin = (bin - 1) >> 3;
+            ancestor = covered.find(bin);
+        }
+
+        // Cut off chunk parts covered by the ancestors.
+        TChunks & cover = covered[it->first];
+        if (ancestor != covered.end())
+        {
+            TChunks const & ancestorCover = ancestor->second;
+            k = 0;
+            for (size_t i = 0; i < length(chunks); ++i)
+            {
+                Pair<__uint64, __uint64> chunk = chunks[i];
+                for (size_t j = 0; j < length(ancestorCover); ++j)
+                {
+                    if (ancestorCover[j].i1 <= chunk.i1 && chunk.i1 < ancestorCover[j].i2)
+                        chunk.i1 = ancestorCover[j].i2;
+                    if (ancestorCover[j].i1 < chunk.i2 && chunk.i2 <= ancestorCover[j].i2)
+                        chunk.i2 = ancestorCover[j].i1;
+                }
+                if (chunk.i1 < chunk.i2)
+                    chunks[k++] = chunk;
+            }
+            resize(chunks, k);
+
+            cover = ancestorCover;
+        }
+        append(cover, chunks);
+        mergeChunks(cover);
+
+        if (empty(chunks) && !keepEmpty)
+            binIndex.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Function optimizeIndex()
+// -----------------------------------------------------------------------------
+
+void optimizeIndex(BamIndex<Csi> & index, BamIndex<Csi> const & fullIndex, GenomicInterval const & interval)
+{
+    // Keep empty bins, their loffset tells readers where to start.
+    optimizeBins(index._binIndices[interval.chrId], regionMinOffset(fullIndex, interval), metaBin(index), true);
+}
+
+// -----------------------------------------------------------------------------
+
+void optimizeIndex(BamIndex<Bai> & index, BamIndex<Bai> const & fullIndex, GenomicInterval const & interval)
+{
+    BamIndex<Bai>::TBinIndex_ & binIndex = index._binIndices[interval.chrId];
+    optimizeBins(binIndex, regionMinOffset(fullIndex, interval), metaBin(index), false);
+
+    String<__uint64> & linearIndex = index._linearIndices[interval.chrId];
+    if (empty(linearIndex) || interval.end == 0u)
+        return;
+
+    // Drop trailing entries equal to their predecessor; readers use the last entry
+    // for all windows behind the linear index.
+    while (length(linearIndex) > 1u && back(linearIndex) == linearIndex[length(linearIndex) - 2])
+        resize(linearIndex, length(linearIndex) - 1);
+
+    // Drop the whole linear index if no chunk starts before the linear offset of
+    // any query within the interval that uses its bin. The padding up to the
+    // interval begin is then saved, too.
+    __uint64 lastWindow = (_min(interval.end, 1u << 29) - 1) >> 14;
+    typedef BamIndex<Bai>::TBinIndex_::const_iterator TBinIter;
+    for (TBinIter it = binIndex.begin(); it != binIndex.end(); ++it)
+    {
+        if (it->first >= metaBin(index))
+            continue;
+
+        __uint64 window = _min(binLastWindow(it->first, 5), lastWindow);
+        __uint64 maxOffset = queryMinOffset(index, interval.chrId, window << 14);
+        for (unsigned j = 0; j < length(it->second.chunkBegEnds); ++j)
+            if (it->second.chunkBegEnds[j].i1 < maxOffset)
+                return;
+    }
+    clear(linearIndex);
+}
+
+// -----------------------------------------------------------------------------
+// Function sampleQueries()
+// -----------------------------------------------------------------------------
+
+// Lists queries [beg, end) within the interval: the interval ends, the whole
+// interval, a single position and a window at evenly spaced positions, and
+// numRandom random subintervals drawn with the given seed. The interval end is
+// limited to maxPos.
+
+void sampleQueries(String<Pair<__uint32, __uint32> > & queries, GenomicInterval const & interval,
+                   __uint32 maxPos, unsigned numRandom, unsigned seed)
+{
+    clear(queries);
+    __uint32 beg = interval.begin;
+    __uint32 end = _min(interval.end, maxPos);
+    if (beg >= end)
+    {
+        appendValue(queries, Pair<__uint32, __uint32>(beg, beg + 1));
+        return;
+    }
+
+    appendValue(queries, Pair<__uint32, __uint32>(beg, beg + 1));
+    appendValue(queries, Pair<__uint32, __uint32>(end - 1, end));
+    appendValue(queries, Pair<__uint32, __uint32>(beg, end));
+
+    __uint64 step = _max((__uint64)1 << 14, ((__uint64)end - beg) / 64);
+    for (__uint64 pos = beg; pos < end; pos += step)
+    {
+        appendValue(queries, Pair<__uint32, __uint32>(pos, pos + 1));
+        appendValue(queries, Pair<__uint32, __uint32>(pos, _min(pos + (1 << 14), (__uint64)end)));
+    }
+
+    std::mt19937 rng(seed ^ (interval.chrId * 1000003u + beg));
+    for (unsigned i = 0; i < numRandom; ++i)
+    {
+        __uint32 qBeg = beg + rng() % (end - beg);
+        __uint32 maxLen = _min(end - qBeg, 1u << (rng() % 25));
+        appendValue(queries, Pair<__uint32, __uint32>(qBeg, qBeg + 1 + rng() % maxLen));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Function maxPosition()
+// -----------------------------------------------------------------------------
+
+// Returns a position behind all alignments of the reference in the index.
+
+__uint32 maxPosition(BamIndex<Bai> const & index, size_t chrId)
+{
+    if (empty(index._linearIndices[chrId]))
+        return 1u << 29;
+    return _min(length(index._linearIndices[chrId]) << 14, (size_t)1 << 29);
+}
+
+// -----------------------------------------------------------------------------
+
+__uint32 maxPosition(BamIndex<Csi> const & index, size_t /*chrId*/)
+{
+    __uint64 maxPos = (__uint64)1 << (index._minShift + 3 * index._depth);
+    return _min(maxPos, (__uint64)MaxValue<__uint32>::VALUE);
+}
+
+// -----------------------------------------------------------------------------
+// Function verifyOptimizedIndex()
+// -----------------------------------------------------------------------------
+
+// Compares the optimized with the unoptimized crop on sampled queries within the
+// interval. Both must resolve to the same file ranges beyond the offset that the
+// full index skips to, and the optimized index must not make a reader visit more
+// than the unoptimized one.
+
+template <typename TTag>
+bool verifyOptimizedIndex(BamIndex<TTag> const & fullIndex, BamIndex<TTag> const & cropped,
+                          BamIndex<TTag> const & optimized, GenomicInterval const & interval)
+{
+    String<Pair<__uint32, __uint32> > queries;
+    sampleQueries(queries, interval, maxPosition(fullIndex, interval.chrId), 256, 0u);
+
+    String<Pair<__uint32, __uint32> > binRanges;
+    String<Pair<__uint64, __uint64> > expected, actual;
+    for (unsigned i = 0; i < length(queries); ++i)
+    {
+        __uint32 beg = queries[i].i1;
+        __uint32 end = queries[i].i2;
+
+        __uint64 minOffset = queryMinOffset(fullIndex, interval.chrId, beg);
+        queryChunks(expected, binRanges, cropped, interval.chrId, beg, end, minOffset);
+        queryChunks(actual, binRanges, optimized, interval.chrId, beg, end, minOffset);
+        if (length(expected) != length(actual) || !rangesContained(actual, expected))
+            return false;
+
+        queryChunks(expected, binRanges, cropped, interval.chrId, beg, end);
+        queryChunks(actual, binRanges, optimized, interval.chrId, beg, end);
+        if (!rangesContained(actual, expected))
+            return false;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function verifyIndex()
+// -----------------------------------------------------------------------------
+
+// Compares the index written for the interval with the full index on edge-case
+// and numRandom random queries within the interval. Beyond the offset that the
+// full index skips to, both must resolve to the same file ranges, and a reader
+// using the written index must visit all of these ranges. The first query that
+// fails is returned in failed.
+
+template <typename TTag>
+bool verifyIndex(Pair<__uint32, __uint32> & failed, BamIndex<TTag> const & fullIndex, BamIndex<TTag> const & index,
+                 GenomicInterval const & interval, unsigned numRandom)
+{
+    String<Pair<__uint32, __uint32> > queries;
+    sampleQueries(queries, interval, maxPosition(fullIndex, interval.chrId), numRandom, 0x5eed5eedu);
+
+    String<Pair<__uint32, __uint32> > binRanges;
+    String<Pair<__uint64, __uint64> > expected, actual;
+    for (unsigned i = 0; i < length(queries); ++i)
+    {
+        __uint32 beg = queries[i].i1;
+        __uint32 end = queries[i].i2;
+        failed = queries[i];
+
+        __uint64 minOffset = queryMinOffset(fullIndex, interval.chrId, beg);
+        queryChunks(expected, binRanges, fullIndex, interval.chrId, beg, end, minOffset);
+        queryChunks(actual, binRanges, index, interval.chrId, beg, end, minOffset);
+        if (length(expected) != length(actual) || !rangesContained(actual, expected))
+            return false;
+
+        queryChunks(actual, binRanges, index, interval.chrId, beg, end);
+        if (!rangesContained(expected, actual))
+            return false;
+    }
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// Function windowOffsets()
+// -----------------------------------------------------------------------------
+
+// Lists for each window of minimal size in [begWindow, endWindow) the smallest
+// virtual file offset of the chunks in the bins on the deepest level at or behind
+// the window, followed by the largest chunk end of these bins. As the bam file is
+// sorted, the difference of two offsets estimates the bytes between the windows.
+
+template <typename TTag>
+void windowOffsets(String<__uint64> & offsets, BamIndex<TTag> const & index, size_t chrId,
+                   __uint64 begWindow, __uint64 endWindow)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator  TBinIter;
+
+    int depth = binningDepth(index);
+    __uint32 firstLeaf = levelFirstBin(depth);
+
+    clear(offsets);
+    resize(offsets, endWindow - begWindow + 1, maxValue<__uint64>());
+    __uint64 endOffset = 0;
+
+    TBinIndex const & binIndex = index._binIndices[chrId];
+    for (TBinIter it = binIndex.lower_bound(firstLeaf + begWindow); it != binIndex.end(); ++it)
+    {
+        if (it->first == metaBin(index) || it->first >= firstLeaf + endWindow)
+            break;
+        for (unsigned j = 0; j < length(it->second.chunkBegEnds); ++j)
+        {
+            __uint64 & offset = offsets[it->first - firstLeaf - begWindow];
+            offset = _min(offset, it->second.chunkBegEnds[j].i1);
+            endOffset = _max(endOffset, it->second.chunkBegEnds[j].i2);
+        }
+    }
+
+    back(offsets) = endOffset;
+    for (size_t w = length(offsets) - 1; w > 0; --w)
+        offsets[w - 1] = _min(offsets[w - 1], offsets[w]);
+}
+
+// -----------------------------------------------------------------------------
+// Function lastDataWindow()
+// -----------------------------------------------------------------------------
+
+// Returns the last window of minimal size that a bin on the deepest level holds
+// chunks for, or the last window before maxPosition() if there is none.
+
+template <typename TTag>
+__uint64 lastDataWindow(BamIndex<TTag> const & index, size_t chrId)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+
+    int depth = binningDepth(index);
+    __uint32 firstLeaf = levelFirstBin(depth);
+
+    TBinIndex const & binIndex = index._binIndices[chrId];
+    for (typename TBinIndex::const_reverse_iterator it = binIndex.rbegin(); it != binIndex.rend(); ++it)
+        if (it->first != metaBin(index) && it->first >= firstLeaf && !empty(it->second.chunkBegEnds))
+            return binLastWindow(it->first, depth);
+
+    return ((__uint64)maxPosition(index, chrId) >> binningMinShift(index)) - 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function shardInterval()
+// -----------------------------------------------------------------------------
+
+// Splits the interval into at most numShards shards of about equal compressed
+// bytes in the bam file. The shard boundaries are aligned to the windows of
+// minimal size; the interval is split by length if the index holds no chunks.
+
+template <typename TTag>
+void shardInterval(String<GenomicInterval> & shards, BamIndex<TTag> const & index, GenomicInterval const & interval,
+                   unsigned numShards)
+{
+    clear(shards);
+
+    int shift = binningMinShift(index);
+    __uint64 begWindow = interval.begin >> shift;
+    __uint64 endWindow = (((__uint64)interval.end - 1) >> shift) + 1;
+    endWindow = _min(endWindow, lastDataWindow(index, interval.chrId) + 1);
+    if (numShards < 2 || endWindow <= begWindow + 1)
+    {
+        appendValue(shards, interval);
+        return;
+    }
+
+    String<__uint64> offsets;
+    windowOffsets(offsets, index, interval.chrId, begWindow, endWindow);
+    size_t numWindows = endWindow - begWindow;
+    if (offsets[0] >= offsets[numWindows])
+    {
+        // No chunks, use the window numbers instead.
+        for (size_t w = 0; w <= numWindows; ++w)
+            offsets[w] = w;
+    }
+
+    // Cut at the first window whose offset reaches the next quantile of the bytes.
+    GenomicInterval shard = interval;
+    double total = offsets[numWindows] - offsets[0];
+    unsigned k = 1;
+    for (size_t w = 1; w < numWindows && k < numShards; ++w)
+    {
+        if (offsets[w] - offsets[0] < total * k / numShards)
+            continue;
+        while (k < numShards && offsets[w] - offsets[0] >= total * k / numShards)
+            ++k;
+
+        __uint64 cut = (begWindow + w) << shift;
+        if (cut <= shard.begin || cut >= interval.end)
+            continue;
+        shard.end = cut;
+        appendValue(shards, shard);
+        shard.begin = cut;
+    }
+    shard.end = interval.end;
+    appendValue(shards, shard);
+}
+
+// -----------------------------------------------------------------------------
+// Function shardRegions()
+// -----------------------------------------------------------------------------
+
+// Replaces the regions of the plan by their shards. Shards are named
+// 'chr:begin-end', or 'chr:begin' if they extend to the end of the reference;
+// regions that are not split keep their name.
+
+template <typename TTag>
+void shardRegions(RegionPlan & plan, BamIndex<TTag> const & index, ContigDictionary const & refNames, unsigned numShards)
+{
+    String<GenomicInterval> intervals;
+    TRegionNames regionNames;
+    String<GenomicInterval> shards;
+    std::string label;
+
+    for (unsigned i = 0; i < length(plan.intervals); ++i)
+    {
+        shardInterval(shards, index, plan.intervals[i], numShards);
+        if (length(shards) == 1)
+        {
+            appendValue(intervals, plan.intervals[i]);
+            appendValue(regionNames, plan.regionNames[i]);
+            continue;
+        }
+
+        for (unsigned j = 0; j < length(shards); ++j)
+        {
+            char buffer[32];
+            int len = (shards[j].end == MaxValue<__uint32>::VALUE)
+                    ? snprintf(buffer, sizeof(buffer), ":%u", shards[j].begin + 1)
+                    : snprintf(buffer, sizeof(buffer), ":%u-%u", shards[j].begin + 1, shards[j].end);
+            label.assign(begin(refNames.names[shards[j].chrId], Standard()), end(refNames.names[shards[j].chrId], Standard()));
+            label.append(buffer, len);
+
+            appendValue(intervals, shards[j]);
+            appendValue(regionNames, label);
+        }
+    }
+
+    std::cerr << "Split " << length(plan.intervals) << " regions into " << length(intervals) << " shards." << std::endl;
+
+    plan.intervals = intervals;
+    plan.regionNames = regionNames;
+}
+
+
+// -----------------------------------------------------------------------------
+// Function printBamIndex()                              // only for debugging
+// -----------------------------------------------------------------------------
+
+void printBamIndex(BamIndex<Csi> & csi)
+{
+    std::cout << "Number of bits for the minimal interval: " << csi._minShift << std::endl;
+    std::cout << "Depth of the binning index: " << csi._depth << std::endl;
     std::cout << "Length of auxiliary data: " << length(csi._aux) << std::endl;
     std::cout << "Length of bin indices: " << length(csi._binIndices) << std::endl;
     std::cout << std::endl;
 
-    std::cout << "Auxiliary data: " << std::endl;
-    for (unsigned i = 0; i < length(csi._aux); ++i)
-        std::cout << "  Aux data " << i << ": " << csi._aux[i] << std::endl;
-    std::cout << std::endl;
+    std::cout << "Auxiliary data: " << std::endl;
+    for (unsigned i = 0; i < length(csi._aux); ++i)
+        std::cout << "  Aux data " << i << ": " << csi._aux[i] << std::endl;
+    std::cout << std::endl;
+
+    for (unsigned i = 0; i < length(csi._binIndices); ++i)
+    {
+        if (csi._binIndices[i].size() == 0) continue;
+        std::cout << "Bin index " << i << " has size " << csi._binIndices[i].size() << std::endl;
+        for (BamIndex<Csi>::TBinIndex_::iterator it = csi._binIndices[i].begin(); it != csi._binIndices[i].end(); ++it)
+        {
+            std::cout << "  Bin " << it->first << ", loffset " << (it->second).loffset << " has " << length((it->second).chunkBegEnds) << " chunks." << std::endl;
+            for (unsigned j = 0; j < length((it->second).chunkBegEnds); ++j)
+                std::cout << "    chunkBeg: " << (it->second).chunkBegEnds[j].i1
+                          << ", chunkEnd: " << (it->second).chunkBegEnds[j].i2
+                          << ", diff: " << ((it->second).chunkBegEnds[j].i2 - (it->second).chunkBegEnds[j].i1) << std::endl;
+        }
+        std::cout << std::endl;
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void printBamIndex(BamIndex<Bai> & bai)
+{
+    std::cout << "Length of bin indices: " << length(bai._binIndices) << std::endl;
+    std::cout << "Length of linear indices: " << length(bai._linearIndices) << std::endl;
+    std::cout << std::endl;
+
+    for (unsigned i = 0; i < length(bai._binIndices); ++i)
+    {
+        if (bai._binIndices[i].size() == 0) continue;
+        std::cout << "Bin index " << i << " has size " << bai._binIndices[i].size() << std::endl;
+        for (BamIndex<Bai>::TBinIndex_::iterator it = bai._binIndices[i].begin(); it != bai._binIndices[i].end(); ++it)
+        {
+            std::cout << "  Bin " << it->first << " has " << length((it->second).chunkBegEnds) << " chunks." << std::endl;
+            for (unsigned j = 0; j < length((it->second).chunkBegEnds); ++j)
+                std::cout << "    chunkBeg: " << (it->second).chunkBegEnds[j].i1
+                          << ", chunkEnd: " << (it->second).chunkBegEnds[j].i2
+                          << ", diff: " << ((it->second).chunkBegEnds[j].i2 - (it->second).chunkBegEnds[j].i1) << std::endl;
+        }
+        std::cout << std::endl;
+    }
+
+    for (unsigned i = 0; i < length(bai._linearIndices); ++i)
+    {
+        if (length(bai._linearIndices[i]) == 0) continue;
+        std::cout << "Linear index " << i << " has size " << length(bai._linearIndices[i]) << std::endl;
+        for (unsigned j = _max(0, (int)length(bai._linearIndices[i])-100); j < length(bai._linearIndices[i]); ++j)
+            std::cout << "  " << j << "/" << length(bai._linearIndices[i]) << ": " << bai._linearIndices[i][j] << std::endl;
+        std::cout << std::endl;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// Function saveIndex()
+// -----------------------------------------------------------------------------
+
+template <typename TStream>
+bool saveIndex(BamIndex<Bai> const & index, TStream & out)
+{
+    SEQAN_ASSERT_EQ(length(index._binIndices), length(index._linearIndices));
+
+    // Write header.
+    out.write("BAI\1", 4);
+    __int32 numRefSeqs = length(index._binIndices);
+    out.write(reinterpret_cast<char *>(&numRefSeqs), 4);
+
+    // Write out indices.
+    typedef BamIndex<Bai> const                TBamIndex;
+    typedef TBamIndex::TBinIndex_ const        TBinIndex;
+    typedef TBinIndex::const_iterator          TBinIndexIter;
+    typedef TBamIndex::TLinearIndex_           TLinearIndex;
+    for (int i = 0; i < numRefSeqs; ++i)
+    {
+        TBinIndex const & binIndex = index._binIndices[i];
+        TLinearIndex const & linearIndex = index._linearIndices[i];
+
+        // Write out binning index.
+        __int32 numBins = binIndex.size();
+        out.write(reinterpret_cast<char *>(&numBins), 4);
+        for (TBinIndexIter itB = binIndex.begin(), itBEnd = binIndex.end(); itB != itBEnd; ++itB)
+        {
+            // Write out bin id.
+            out.write(reinterpret_cast<char const *>(&itB->first), 4);
+
+            // Write out number of chunks.
+            __uint32 numChunks = length(itB->second.chunkBegEnds);
+            out.write(reinterpret_cast<char *>(&numChunks), 4);
+
+            // Write out all chunks.
+            typedef Iterator<String<Pair<__uint64> > const, Rooted>::Type TChunkIter;
+            for (TChunkIter itC = begin(itB->second.chunkBegEnds); !atEnd(itC); goNext(itC))
+            {
+                out.write(reinterpret_cast<char const *>(&itC->i1), 8);
+                out.write(reinterpret_cast<char const *>(&itC->i2), 8);
+            }
+        }
+
+        // Write out linear index.
+        __int32 numIntervals = length(linearIndex);
+        out.write(reinterpret_cast<char *>(&numIntervals), 4);
+        typedef Iterator<String<__uint64> const, Rooted>::Type TLinearIndexIter;
+        for (TLinearIndexIter it = begin(linearIndex, Rooted()); !atEnd(it); goNext(it))
+            out.write(reinterpret_cast<char const *>(&*it), 8);
+    }
+
+    // Write the number of unaligned reads if set.
+    if (index._unalignedCount != maxValue<__uint64>())
+        out.write(reinterpret_cast<char const *>(&index._unalignedCount), 8);
+
+    return out.good();  // false on error, true on success.
+}
+
+
+// -----------------------------------------------------------------------------
+// Function chopRegion()
+// -----------------------------------------------------------------------------
+
+// Crops region i from the input index, optimizes and verifies it if wished and
+// writes it. The buffers are reused across the regions of a thread. Waits until
+// the input index is loaded far enough for the region's reference.
+
+template<typename TTag>
+int chopRegion(OutputWriter & writer, ChopStats & stats, IndexQueryBuffers & buffers, std::ostringstream & out,
+               MateScan & mates, BamIndex<TTag> const & inIndex, IndexProgress & progress, RegionPlan const & plan,
+               unsigned i, ChopBaiOptions const & options)
+{
+    if (!waitForReference(progress, inIndex, plan.intervals[i].chrId))
+        return 1;  // Reported after loading.
+    if ((options.keepUnmapped || options.addMates) && !waitForIndex(progress))
+        return 1;
+
+    // Crop the region from the input bam index.
+    BamIndex<TTag> outIndex;
+    GenomicInterval const & interval = plan.intervals[i];
+    cropRegion(outIndex, buffers, inIndex, interval, options.writeLinear);
+    if (options.keepUnmapped)
+        cropUnmapped(outIndex, inIndex);
+
+    out.str("");
+    if (!saveIndex(outIndex, out))
+        return 1;
+    stats.bytesCropped += out.tellp();
+
+    // Reduce the index further if it still gives the same answers.
+    BamIndex<TTag> optIndex;
+    BamIndex<TTag> * written = &outIndex;
+    if (options.optimize)
+    {
+        optIndex = outIndex;
+        optimizeIndex(optIndex, inIndex, plan.intervals[i]);
+        if (verifyOptimizedIndex(inIndex, outIndex, optIndex, plan.intervals[i]))
+        {
+            out.str("");
+            if (!saveIndex(optIndex, out))
+                return 1;
+            written = &optIndex;
+        }
+        else
+        {
+            SEQAN_OMP_PRAGMA(critical (cerr))
+            std::cerr << "WARNING: Optimized index for region " << plan.regionNames[i]
+                      << " failed verification. Writing the unoptimized index." << std::endl;
+            ++stats.numUnverified;
+        }
+    }
+
+    // Check the index against the full index.
+    if (options.verify)
+    {
+        Pair<__uint32, __uint32> query;
+        ++stats.numVerified;
+        if (!verifyIndex(query, inIndex, *written, plan.intervals[i], options.verifyQueries))
+        {
+            SEQAN_OMP_PRAGMA(critical (cerr))
+            std::cerr << "ERROR: Verification failed for region " << plan.regionNames[i] << ": query of positions "
+                      << query.i1 + 1 << "-" << query.i2 << " resolves to different file ranges than the full index."
+                      << std::endl;
+            ++stats.numMismatches;
+            return 1;
+        }
+    }
+
+    // Add the bins and chunks of the mates outside the region.
+    if (options.addMates)
+    {
+        if (!collectMates(mates, inIndex, plan.intervals[i], options.maxMateWindows))
+        {
+            SEQAN_OMP_PRAGMA(critical (cerr))
+            std::cerr << "ERROR: Could not read the alignments of region " << plan.regionNames[i] << " from "
+                      << mates.bamfile << std::endl;
+            return 1;
+        }
+        addMates(*written, inIndex, mates, buffers.binRanges);
+        stats.numMateWindows += mates.windows.size();
+        if (mates.capped)
+            ++stats.numMatesCapped;
+
+        out.str("");
+        if (!saveIndex(*written, out))
+            return 1;
+    }
+
+    stats.bytesWritten += out.tellp();
+    ++stats.numIndices;
+
+    // Write the output bam index for the region.
+    if (!writeRegion(writer, plan.regionNames[i], out.str()))
+        return 1;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function addStats()
+// -----------------------------------------------------------------------------
+
+void addStats(ChopStats & total, ChopStats const & stats)
+{
+    total.numIndices += stats.numIndices;
+    total.bytesCropped += stats.bytesCropped;
+    total.bytesWritten += stats.bytesWritten;
+    total.numUnverified += stats.numUnverified;
+    total.numVerified += stats.numVerified;
+    total.numMismatches += stats.numMismatches;
+    total.numMateWindows += stats.numMateWindows;
+    total.numMatesCapped += stats.numMatesCapped;
+}
+
+// -----------------------------------------------------------------------------
+// Function chopIndex()
+// -----------------------------------------------------------------------------
+
+// Chops all regions of the plan from the input index with options.numThreads
+// threads. Within cohort mode, where the bam files are already processed in
+// parallel, the regions are chopped by the calling thread. The input index may
+// still be loading as tracked by progress.
+
+template<typename TTag>
+int chopIndex(OutputWriter & writer, ChopStats & stats, BamIndex<TTag> const & inIndex, IndexProgress & progress,
+              RegionPlan const & plan, CharString const & bamfile, ChopBaiOptions const & options)
+{
+    int numRegions = length(plan.intervals);
+    int numFailed = 0;
+
+    SEQAN_OMP_PRAGMA(parallel if (!omp_in_parallel()) num_threads(options.numThreads) reduction(+:numFailed))
+    {
+        IndexQueryBuffers buffers;
+        std::ostringstream out(std::ios::binary | std::ios::out);
+        MateScan mates(bamfile);
+        ChopStats threadStats;
+
+        // Iterate regions. The threads share the input index, which is only read.
+        SEQAN_OMP_PRAGMA(for schedule(dynamic, 16))
+        for (int i = 0; i < numRegions; ++i)
+            if (chopRegion(writer, threadStats, buffers, out, mates, inIndex, progress, plan, i, options) != 0)
+                ++numFailed;
+
+        SEQAN_OMP_PRAGMA(critical (stats))
+        addStats(stats, threadStats);
+    }
+
+    // Write the regions still queued for io_uring.
+    if (!flush(writer))
+        ++numFailed;
+
+    return numFailed == 0 ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function printStats()
+// -----------------------------------------------------------------------------
+
+void printStats(ChopStats const & stats, ChopBaiOptions const & options)
+{
+    if (options.optimize)
+    {
+        std::cerr << "Optimized " << stats.numIndices << " indices: " << stats.bytesCropped << " bytes before and "
+                  << stats.bytesWritten << " bytes after optimization." << std::endl;
+        if (stats.numUnverified > 0)
+            std::cerr << "WARNING: " << stats.numUnverified << " indices were written unoptimized." << std::endl;
+    }
+
+    if (options.verify)
+        std::cerr << "Verified " << stats.numVerified << " indices against the full index: "
+                  << stats.numMismatches << " failed." << std::endl;
+
+    if (options.addMates)
+    {
+        std::cerr << "Added " << stats.numMateWindows << " windows with mates to " << stats.numIndices << " indices."
+                  << std::endl;
+        if (stats.numMatesCapped > 0)
+            std::cerr << "WARNING: " << stats.numMatesCapped << " regions have mates in more than "
+                      << options.maxMateWindows << " windows; the mates in further windows were not added." << std::endl;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Function indexCacheFile()
+// -----------------------------------------------------------------------------
+
+CharString indexCacheFile(CharString const & indexfile)
+{
+    CharString cacheFile = indexfile;
+    cacheFile += ".chopcache";
+    return cacheFile;
+}
+
+// -----------------------------------------------------------------------------
+// Function openIndex()
+// -----------------------------------------------------------------------------
+
+// Opens the bam index. With useCache, a valid cache of the index is mapped
+// instead and the index has to be filled by loadIndex() once the references of
+// interest are known; a missing or outdated cache is written.
+
+template<typename TTag>
+bool openIndex(BamIndex<TTag> & index, IndexCache & cache, CharString const & indexfile, bool useCache)
+{
+    CharString cacheFile = indexCacheFile(indexfile);
+    if (useCache && open(cache, toCString(cacheFile), toCString(indexfile), TTag()))
+        return true;
+
+    // The cache records the index file as it was before reading it.
+    struct stat source;
+    useCache = useCache && fileStat(source, toCString(indexfile));
+    if (!open(index, toCString(indexfile)))
+        return false;
+
+    if (useCache && !saveIndexCache(index, toCString(cacheFile), source))
+    {
+        SEQAN_OMP_PRAGMA(critical (cerr))
+        std::cerr << "WARNING: Could not write index cache " << cacheFile << std::endl;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function loadIndex()
+// -----------------------------------------------------------------------------
+
+// Fills the index from the cache mapped by openIndex() for the references with
+// regions in the plan, or for all references with allRefs. Does nothing if the
+// index was parsed.
+
+template<typename TTag>
+void loadIndex(BamIndex<TTag> & index, IndexCache & cache, RegionPlan const & plan, bool allRefs)
+{
+    if (empty(cache.file))
+        return;
+
+    String<bool> refs;
+    resize(refs, plan.numRefs, allRefs);
+    for (unsigned i = 0; i < length(plan.intervals); ++i)
+        refs[plan.intervals[i].chrId] = true;
+
+    loadIndex(index, cache, refs);
+    close(cache.file);
+}
+
+// -----------------------------------------------------------------------------
+// Function joinIndexLoader()
+// -----------------------------------------------------------------------------
+
+// Waits for the thread loading the input bam index, if any, and reports if the
+// index could not be loaded or lacks some of the numRefs references.
+
+template<typename TTag>
+bool joinIndexLoader(std::thread & loader, IndexProgress const & progress, BamIndex<TTag> const & index,
+                     CharString const & indexfile, size_t numRefs)
+{
+    if (loader.joinable())
+        loader.join();
+
+    if (!progress.ok)
+    {
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return false;
+    }
+    if (numRefs != 0 && length(index._binIndices) != numRefs)
+    {
+        std::cerr << "ERROR: Number of references in " << indexfile << " does not match the bam file." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function checkReferenceCount()
+// -----------------------------------------------------------------------------
+
+// Waits until the number of references of the input bam index is known and checks
+// that it matches the numRefs references of the bam header or contigs file, before
+// any region is chopped. An index that fails to load is reported by
+// joinIndexLoader().
+
+template<typename TTag>
+bool checkReferenceCount(IndexProgress & progress, BamIndex<TTag> const & index, CharString const & indexfile,
+                         size_t numRefs)
+{
+    // The size of the index is set before its first reference is complete.
+    if (!waitForReferences(progress, 1))
+        return true;
+
+    if (length(index._binIndices) != numRefs)
+    {
+        std::cerr << "ERROR: Number of references in " << indexfile << " (" << length(index._binIndices)
+                  << ") does not match the bam header or contigs file (" << numRefs << ")." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function chopBam()
+// -----------------------------------------------------------------------------
+
+template<typename TTag>
+int chopBam(CharString & indexfile, ChopBaiOptions & options, TTag)
+{
+    // Map the index cache or read the input bam index in the background. The
+    // regions of a reference are chopped as soon as its part of the index is read.
+    BamIndex<TTag> inIndex;
+    IndexCache cache;
+    IndexProgress progress;
+    std::thread loader;
+    bool useCache = options.indexCache &&
+                    open(cache, toCString(indexCacheFile(indexfile)), toCString(indexfile), TTag());
+    struct stat source;
+    bool saveCache = options.indexCache && !useCache && fileStat(source, toCString(indexfile));
+    if (!useCache)
+        loader = startReadIndex(inIndex, indexfile, progress);
+
+    // Resolve the regions to reference ids meanwhile.
+    ContigDictionary refNames;
+    RegionPlan plan;
+    if (readContigs(refNames, options.contigsFile, options.bamfile) != 0 ||
+        parseIntervals(plan, options.regions, refNames) != 0 ||
+        (options.rechop && checkParentRegion(plan, refNames, indexfile, options.parentRegion) != 0))
+    {
+        joinIndexLoader(loader, progress, inIndex, indexfile, 0);
+        return 1;
+    }
+    loadIndex(inIndex, cache, plan, options.keepUnmapped || options.addMates);
+    if (!checkReferenceCount(progress, inIndex, indexfile, plan.numRefs))
+    {
+        joinIndexLoader(loader, progress, inIndex, indexfile, 0);
+        return 1;
+    }
+
+    // Split the regions into shards of about equal compressed bytes. This needs
+    // the complete index.
+    if (options.numShards > 1)
+    {
+        if (!waitForReferences(progress, plan.numRefs))
+        {
+            joinIndexLoader(loader, progress, inIndex, indexfile, plan.numRefs);
+            return 1;
+        }
+        shardRegions(plan, inIndex, refNames, options.numShards);
+    }
+
+    // Open the output directory.
+    OutputWriter writer;
+    if (!open(writer, options.outputPrefix, indexfile, options.bamfile, options.createSymlink, options.fanOut,
+              options.ioUring))
+    {
+        joinIndexLoader(loader, progress, inIndex, indexfile, 0);
+        return 1;
+    }
+
+    ChopStats stats;
+    int res = chopIndex(writer, stats, inIndex, progress, plan, options.bamfile, options);
+    close(writer);
+    if (!joinIndexLoader(loader, progress, inIndex, indexfile, plan.numRefs))
+        return 1;
+    printStats(stats, options);
+
+    // Write the index cache for the next run, recording the index file as it was
+    // before reading it.
+    if (saveCache && !saveIndexCache(inIndex, toCString(indexCacheFile(indexfile)), source))
+        std::cerr << "WARNING: Could not write index cache " << indexCacheFile(indexfile) << std::endl;
+
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function spannedBytes()
+// -----------------------------------------------------------------------------
+
+// Returns the compressed bytes between the first and the last block of each file range.
+
+__uint64 spannedBytes(String<Pair<__uint64, __uint64> > const & ranges)
+{
+    __uint64 numBytes = 0;
+    for (unsigned i = 0; i < length(ranges); ++i)
+        numBytes += (ranges[i].i2 >> 16) - (ranges[i].i1 >> 16);
+    return numBytes;
+}
+
+// -----------------------------------------------------------------------------
+// Function csiDepth()
+// -----------------------------------------------------------------------------
+
+// Returns the smallest depth of a CSI with the given minimal shift that covers
+// references of maxLength and some more, as 'samtools index -c'. The depth is 0
+// if the root bin alone covers them.
+
+unsigned csiDepth(unsigned minShift, __uint64 maxLength)
+{
+    unsigned depth = 0;
+    for (__uint64 extent = (__uint64)1 << minShift; maxLength + 256 > extent; extent <<= 3)
+        ++depth;
+    return depth;
+}
+
+// -----------------------------------------------------------------------------
+// Function reportQueryBytes()
+// -----------------------------------------------------------------------------
+
+// Reports the average compressed bytes spanned by sampled queries within the
+// regions with the original index and with the rebuilt CSI. All threads query
+// the same indices, each with its own buffers.
+
+template<typename TTag>
+void reportQueryBytes(SharedBamIndex<TTag> const & index, BamIndex<Csi> const & csi, RegionPlan const & plan,
+                      ContigDictionary const & refNames, unsigned numThreads)
+{
+    int numRegions = length(plan.intervals);
+    __uint64 numQueries = 0;
+    __uint64 indexBytes = 0;
+    __uint64 csiBytes = 0;
+
+    SEQAN_OMP_PRAGMA(parallel num_threads(numThreads) reduction(+:numQueries, indexBytes, csiBytes))
+    {
+        String<Pair<__uint32, __uint32> > queries;
+        IndexQueryBuffers buffers;
+        String<Pair<__uint64, __uint64> > ranges;
+
+        SEQAN_OMP_PRAGMA(for schedule(dynamic, 16))
+        for (int i = 0; i < numRegions; ++i)
+        {
+            GenomicInterval query = plan.intervals[i];
+            sampleQueries(queries, plan.intervals[i], refNames.lengths[query.chrId], 256, 0u);
+            for (unsigned j = 0; j < length(queries); ++j)
+            {
+                query.begin = queries[j].i1;
+                query.end = queries[j].i2;
+                queryRegion(ranges, buffers, index, query);
+                indexBytes += spannedBytes(ranges);
+                queryRegion(ranges, buffers, csi, query);
+                csiBytes += spannedBytes(ranges);
+            }
+            numQueries += length(queries);
+        }
+    }
+
+    double indexAverage = (numQueries > 0) ? (double)indexBytes / numQueries : 0.0;
+    double csiAverage = (numQueries > 0) ? (double)csiBytes / numQueries : 0.0;
+    std::cerr << "Rebuilt the index as CSI with minimal shift " << csi._minShift << " and depth " << csi._depth
+              << ". " << numQueries << " sampled queries span " << indexAverage << " compressed bytes on average "
+              << "with the original index and " << csiAverage << " with the CSI";
+    if (indexBytes > 0)
+        std::cerr << " (" << 100.0 * ((double)indexBytes - (double)csiBytes) / indexBytes << " % less)";
+    std::cerr << "." << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+// Function convertBam()
+// -----------------------------------------------------------------------------
+
+// Rebuilds the index of the bam file as CSI with the binning given in the options,
+// compares it to the original index on sampled queries and chops it.
+
+template<typename TTag>
+int convertBam(CharString const & indexfile, ChopBaiOptions & options, TTag)
+{
+    SharedBamIndex<TTag> inIndex;
+    if (!open(inIndex, toCString(indexfile)))
+    {
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
+    }
+
+    ContigDictionary refNames;
+    RegionPlan plan;
+    if (readContigs(refNames, options.contigsFile, options.bamfile) != 0 ||
+        parseIntervals(plan, options.regions, refNames) != 0)
+        return 1;
+
+    // Check that the binning covers the references.
+    __uint64 maxLength = 0;
+    for (unsigned i = 0; i < length(refNames.lengths); ++i)
+        maxLength = _max(maxLength, (__uint64)refNames.lengths[i]);
+    unsigned depth = (options.csiDepth != 0) ? options.csiDepth : csiDepth(options.csiMinShift, maxLength);
+    if (((__uint64)1 << (options.csiMinShift + 3 * depth)) <= maxLength)
+    {
+        std::cerr << "ERROR: A CSI with minimal shift " << options.csiMinShift << " and depth " << depth
+                  << " does not cover references of length " << maxLength << "." << std::endl;
+        return 1;
+    }
+
+    BamIndex<Csi> csi;
+    if (!buildCsi(csi, toCString(options.bamfile), options.csiMinShift, depth, options.numThreads, 16u << 20))
+    {
+        std::cerr << "ERROR: Could not build a CSI from " << options.bamfile << ". The bam file must be sorted "
+                  << "by coordinate." << std::endl;
+        return 1;
+    }
+    if (length(csi._binIndices) != length(refNames.names) || length(inIndex.index->_binIndices) != length(refNames.names))
+    {
+        std::cerr << "ERROR: Number of references in " << indexfile << " does not match the bam file." << std::endl;
+        return 1;
+    }
+
+    if (options.numShards > 1)
+        shardRegions(plan, csi, refNames, options.numShards);
+    reportQueryBytes(inIndex, csi, plan, refNames, options.numThreads);
+
+    // Chop the CSI, named after the bam file.
+    CharString csiFile = options.bamfile;
+    csiFile += ".csi";
+    OutputWriter writer;
+    if (!open(writer, options.outputPrefix, csiFile, options.bamfile, options.createSymlink, options.fanOut,
+              options.ioUring))
+        return 1;
+
+    ChopStats stats;
+    IndexProgress progress;
+    int res = chopIndex(writer, stats, csi, progress, plan, options.bamfile, options);
+    close(writer);
+    printStats(stats, options);
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function readBamList()
+// -----------------------------------------------------------------------------
+
+bool readBamList(String<CohortSample> & samples, CharString const & listFile)
+{
+    std::ifstream stream(toCString(listFile));
+    if (!stream.is_open())
+    {
+        std::cerr << "ERROR: Could not open file listing the bam files: " << listFile << std::endl;
+        return 1;
+    }
+
+    std::string line;
+    while (getline(stream, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.resize(line.size() - 1);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        CohortSample sample;
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos)
+        {
+            sample.name = line.substr(0, tab);
+            sample.bamfile = line.substr(tab + 1);
+        }
+        else
+        {
+            // Use the file name without '.bam' as sample name.
+            sample.bamfile = line;
+            size_t slash = line.rfind('/');
+            std::string name = line.substr(slash == std::string::npos ? 0 : slash + 1);
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bam") == 0)
+                name.resize(name.size() - 4);
+            sample.name = name;
+        }
+        appendValue(samples, sample);
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Function chopSample()
+// -----------------------------------------------------------------------------
+
+// Loads the index of one bam file in cohort mode, chops it and releases it.
+
+template<typename TTag>
+int chopSample(ChopStats & stats, CohortSample const & sample, CharString const & indexfile, RegionPlan const & plan,
+               ChopBaiOptions const & options, TTag)
+{
+    BamIndex<TTag> inIndex;
+    IndexCache cache;
+    if (!openIndex(inIndex, cache, indexfile, options.indexCache))
+    {
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
+    }
+    loadIndex(inIndex, cache, plan, options.keepUnmapped || options.addMates);
+    if (length(inIndex._binIndices) != plan.numRefs)
+    {
+        std::cerr << "ERROR: Number of references in " << indexfile << " does not match the regions' bam file." << std::endl;
+        return 1;
+    }
+
+    // Create the output directory of the sample if not exists.
+    CharString sampleDir = options.outputPrefix;
+    sampleDir += "/";
+    sampleDir += sample.name;
+    mkdir(toCString(sampleDir), 0755);
+
+    OutputWriter writer;
+    if (!open(writer, sampleDir, indexfile, sample.bamfile, options.createSymlink, options.fanOut, options.ioUring))
+        return 1;
+
+    IndexProgress progress;
+    int res = chopIndex(writer, stats, inIndex, progress, plan, sample.bamfile, options);
+    close(writer);
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function chopCohort()
+// -----------------------------------------------------------------------------
+
+// Chops the indices of all bam files listed in options.bamfile. The regions are
+// parsed once and shared; the candidate bin ranges are looked up per query.
+// options.numThreads indices are held in memory at a time.
+
+int chopCohort(ChopBaiOptions & options)
+{
+    String<CohortSample> samples;
+    if (readBamList(samples, options.bamfile) != 0)
+        return 1;
+    if (empty(samples))
+    {
+        std::cerr << "ERROR: No bam files listed in " << options.bamfile << std::endl;
+        return 1;
+    }
+
+    // Resolve the regions using the reference names of the first bam file.
+    ContigDictionary refNames;
+    RegionPlan plan;
+    if (readContigs(refNames, options.contigsFile, samples[0].bamfile) != 0 ||
+        parseIntervals(plan, options.regions, refNames) != 0)
+        return 1;
+
+    int numFailed = 0;
+    int numSamples = length(samples);
+    ChopStats totalStats;
+
+    SEQAN_OMP_PRAGMA(parallel for schedule(dynamic, 1) num_threads(options.numThreads) reduction(+:numFailed))
+    for (int i = 0; i < numSamples; ++i)
+    {
+        CharString indexfile;
+        ChopStats stats;
+        int res = 1;
+        if (findIndexFile(indexfile, samples[i].bamfile) == 0)
+        {
+            if (suffix(indexfile, length(indexfile) - 3) == "bai")
+                res = chopSample(stats, samples[i], indexfile, plan, options, Bai());
+            else
+                res = chopSample(stats, samples[i], indexfile, plan, options, Csi());
+        }
+
+        SEQAN_OMP_PRAGMA(critical (stats))
+        addStats(totalStats, stats);
+
+        if (res != 0)
+        {
+            SEQAN_OMP_PRAGMA(critical (cerr))
+            std::cerr << "ERROR: Chopping failed for sample " << samples[i].name << std::endl;
+            ++numFailed;
+        }
+    }
+
+    printStats(totalStats, options);
+    return numFailed == 0 ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function bamFileOfIndex()
+// -----------------------------------------------------------------------------
+
+// Finds the bam file of an index file FILE.bam.bai or FILE.bai (or .csi) in watch
+// mode. Returns false for other files and indices without bam file.
+
+bool bamFileOfIndex(CharString & bamfile, CharString const & indexfile)
+{
+    if (length(indexfile) < 4 || (suffix(indexfile, length(indexfile) - 4) != ".bai" &&
+                                  suffix(indexfile, length(indexfile) - 4) != ".csi"))
+        return false;
+
+    bamfile = prefix(indexfile, length(indexfile) - 4);
+    if (length(bamfile) < 4 || suffix(bamfile, length(bamfile) - 4) != ".bam")
+        bamfile += ".bam";
+    return fileExists(bamfile);
+}
+
+// -----------------------------------------------------------------------------
+// Function watchStop_()
+// -----------------------------------------------------------------------------
+
+static volatile std::sig_atomic_t watchStopped_ = 0;
+
+extern "C" void watchStop_(int)
+{
+    watchStopped_ = 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function watchWorker()
+// -----------------------------------------------------------------------------
+
+// Chops the index files of the queue one at a time until the queue is closed. The
+// regions are parsed by the first worker that needs them and kept for all further
+// bam files.
+
+void watchWorker(WatchState & state, ChopBaiOptions const & options)
+{
+    // The bam files are processed in parallel; each one is chopped by a single thread.
+    ChopBaiOptions sampleOptions = options;
+    sampleOptions.numThreads = 1;
+
+    CharString indexfile;
+    while (pop(indexfile, state.queue))
+    {
+        CohortSample sample;
+        if (!bamFileOfIndex(sample.bamfile, indexfile))
+        {
+            done(state.queue, indexfile);
+            continue;
+        }
+        sample.name = prefix(sample.bamfile, length(sample.bamfile) - 4);
+        for (unsigned i = length(sample.name); i > 0; --i)
+        {
+            if (sample.name[i - 1] == '/')
+            {
+                sample.name = suffix(sample.name, i);
+                break;
+            }
+        }
+
+        bool ready = false;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (!state.planReady)
+            {
+                ContigDictionary refNames;
+                RegionPlan plan;
+                if (readContigs(refNames, options.contigsFile, sample.bamfile) == 0 &&
+                    parseIntervals(plan, options.regions, refNames) == 0)
+                {
+                    state.refNames = refNames;
+                    state.plan = plan;
+                    state.planReady = true;
+                }
+            }
+            ready = state.planReady;
+        }
+
+        ChopStats stats;
+        int res = 1;
+        if (ready)
+        {
+            if (suffix(indexfile, length(indexfile) - 3) == "bai")
+                res = chopSample(stats, sample, indexfile, state.plan, sampleOptions, Bai());
+            else
+                res = chopSample(stats, sample, indexfile, state.plan, sampleOptions, Csi());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            addStats(state.stats, stats);
+            if (res != 0)
+            {
+                std::cerr << "ERROR: Chopping failed for sample " << sample.name << std::endl;
+                ++state.numFailed;
+            }
+            else
+            {
+                std::cerr << "Chopped " << indexfile << " to " << options.outputPrefix << "/" << sample.name
+                          << std::endl;
+                ++state.numChopped;
+            }
+        }
+
+        // Chop the index again if it was rewritten while it was chopped.
+        done(state.queue, indexfile);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Function chopWatch()
+// -----------------------------------------------------------------------------
+
+// Watches the directory options.bamfile and chops each index file that is closed
+// after writing or moved into it, using options.numThreads worker threads. Runs
+// until SIGINT or SIGTERM; the waiting index files are chopped before returning.
+
+int chopWatch(ChopBaiOptions & options)
+{
+    WatchState state;
+    DirWatcher watcher;
+    if (!open(watcher, options.bamfile))
+    {
+        std::cerr << "ERROR: Could not watch directory " << options.bamfile << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // Check the regions before waiting for the first bam file if the reference
+    // names are given.
+    if (!empty(options.contigsFile))
+    {
+        if (readContigs(state.refNames, options.contigsFile, "") != 0 ||
+            parseIntervals(state.plan, options.regions, state.refNames) != 0)
+            return 1;
+        state.planReady = true;
+    }
+
+    // Interrupt waiting for events on SIGINT and SIGTERM instead of terminating.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watchStop_;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < options.numThreads; ++i)
+        workers.push_back(std::thread(watchWorker, std::ref(state), std::cref(options)));
+
+    std::cerr << "Watching " << options.bamfile << " for index files." << std::endl;
+    int res = 0;
+    String<CharString> files;
+    while (!watchStopped_)
+    {
+        clear(files);
+        if (!readCompleted(files, watcher, 1000))
+        {
+            std::cerr << "ERROR: Stopped watching directory " << options.bamfile << std::endl;
+            res = 1;
+            break;
+        }
+        CharString bamfile;
+        for (unsigned i = 0; i < length(files); ++i)
+            if (bamFileOfIndex(bamfile, files[i]))
+                push(state.queue, files[i]);
+    }
+
+    close(state.queue);
+    for (unsigned i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    std::cerr << "Chopped the indices of " << state.numChopped << " bam files, " << state.numFailed << " failed."
+              << std::endl;
+    printStats(state.stats, options);
+    return (res == 0 && state.numFailed == 0) ? 0 : 1;
+}
+
+
+
+// -----------------------------------------------------------------------------
+// Function setupProfileParser()
+// -----------------------------------------------------------------------------
+
+void setupProfileParser(ArgumentParser & parser, ProfileOptions & options)
+{
+    setShortDescription(parser, "reports the bin and chunk density of a bam index");
+
+    setVersion(parser, "0.1 beta");
+    setDate(parser, DATE);
+
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP");
+
+    addDescription(parser, "Reports statistics of the bai or csi file of the input bamfile for each reference sequence and "
+                           "for windows of fixed size along each reference: the number of bins overlapping the window, the "
+                           "number of chunks in these bins, the compressed bytes of the bam file that a reader visits for "
+                           "the whole window and the size of the index that chopping the window would produce. The "
+                           "report is written to standard output. Positions are 1-based and both endpoints are included.");
+
+    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM-FILE"));
+
+    addSection(parser, "Profile options");
+    addOption(parser, ArgParseOption("w", "window", "Window size.", ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "window", "1");
+    addOption(parser, ArgParseOption("l", "linear", "Include linear index of BAI in the chopped index sizes."));
+    addOption(parser, ArgParseOption("O", "optimize", "Report the sizes of optimized indices as written with -O."));
+    addOption(parser, ArgParseOption("j", "json", "Write JSON instead of tab-separated values."));
+    addOption(parser, ArgParseOption("c", "contigs", "Read the reference names and lengths from a .fai or .dict file "
+                                                     "instead of the bam header.", ArgParseArgument::INPUT_FILE, "FILE"));
+    setValidValues(parser, "contigs", "fai dict");
+
+    setDefaultValue(parser, "window", options.windowSize);
+    setDefaultValue(parser, "linear", options.writeLinear?"true":"false");
+    setDefaultValue(parser, "optimize", options.optimize?"true":"false");
+    setDefaultValue(parser, "json", options.json?"true":"false");
+}
+
+// -----------------------------------------------------------------------------
+// Function parseProfileCommandLine()
+// -----------------------------------------------------------------------------
+
+ArgumentParser::ParseResult parseProfileCommandLine(ProfileOptions & options, int argc, char const ** argv)
+{
+    ArgumentParser parser("chopBAI profile");
+    setupProfileParser(parser, options);
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    getArgumentValue(options.bamfile, parser, 0);
+    if (isSet(parser, "window"))
+        getOptionValue(options.windowSize, parser, "window");
+    if (isSet(parser, "linear"))
+        options.writeLinear = true;
+    if (isSet(parser, "optimize"))
+        options.optimize = true;
+    if (isSet(parser, "json"))
+        options.json = true;
+    if (isSet(parser, "contigs"))
+        getOptionValue(options.contigsFile, parser, "contigs");
+
+    return res;
+}
 
-    for (unsigned i = 0; i < length(csi._binIndices); ++i)
+// -----------------------------------------------------------------------------
+// Function profileInterval()
+// -----------------------------------------------------------------------------
+
+template<typename TTag>
+void profileInterval(IntervalProfile & profile, String<Pair<__uint32, __uint32> > & binRanges,
+                     String<Pair<__uint64, __uint64> > & ranges, std::ostringstream & out, BamIndex<TTag> const & index, GenomicInterval const & interval,
+                     ProfileOptions const & options)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator  TBinIter;
+
+    profile = IntervalProfile();
+    TBinIndex const & binIndex = index._binIndices[interval.chrId];
+
+    // Count the bins and chunks.
+    getCandidateBinRanges(binRanges, interval.begin, interval.end, index);
+    for (unsigned i = 0; i < length(binRanges); ++i)
     {
-        if (csi._binIndices[i].size() == 0) continue;
-        std::cout << "Bin index " << i << " has size " << csi._binIndices[i].size() << std::endl;
-        for (BamIndex<Csi>::TBinIndex_::iterator it = csi._binIndices[i].begin(); it != csi._binIndices[i].end(); ++it)
+        for (TBinIter it = binIndex.lower_bound(binRanges[i].i1); it != binIndex.end() && it->first <= binRanges[i].i2;
+             ++it)
+        {
+            ++profile.numBins;
+            profile.numChunks += length(it->second.chunkBegEnds);
+        }
+    }
+
+    // Chop the interval.
+    BamIndex<TTag> outIndex;
+    cropInterval(outIndex, index, interval, binRanges, options.writeLinear);
+    if (options.optimize)
+        optimizeIndex(outIndex, index, interval);
+    out.str("");
+    saveIndex(outIndex, out);
+    profile.indexBytes = out.tellp();
+
+    // Sum up the compressed bytes that a reader visits.
+    queryChunks(ranges, binRanges, index, interval.chrId, interval.begin, interval.end);
+    profile.bytesSpanned = spannedBytes(ranges);
+}
+
+// -----------------------------------------------------------------------------
+// Function writeJsonString()
+// -----------------------------------------------------------------------------
+
+// Writes str as a JSON string literal, escaping quotes, backslashes and control
+// characters.
+
+void writeJsonString(std::ostream & stream, CharString const & str)
+{
+    stream << '"';
+    for (unsigned i = 0; i < length(str); ++i)
+    {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+        {
+            stream << '\\' << c;
+        }
+        else if (c < 0x20)
+        {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            stream << buffer;
+        }
+        else
+        {
+            stream << c;
+        }
+    }
+    stream << '"';
+}
+
+// -----------------------------------------------------------------------------
+// Function printProfile()
+// -----------------------------------------------------------------------------
+
+// Writes one line of the report. In JSON, the windows of a reference are nested
+// in the object of the reference.
+
+void printProfile(std::ostream & stream, char const * type, CharString const & refName, __uint32 beg, __uint32 end,
+                  IntervalProfile const & profile, bool json)
+{
+    if (!json)
+    {
+        stream << type << '\t' << refName << '\t' << beg + 1 << '\t' << end << '\t' << profile.numBins << '\t'
+               << profile.numChunks << '\t' << profile.bytesSpanned << '\t' << profile.indexBytes << '\n';
+        return;
+    }
+
+    if (strcmp(type, "window") == 0)
+    {
+        stream << "      {\"begin\": " << beg + 1 << ", \"end\": " << end << ", ";
+    }
+    else
+    {
+        stream << "    {\"name\": ";
+        writeJsonString(stream, refName);
+        stream << ", \"length\": " << end << ", ";
+    }
+    stream << "\"bins\": " << profile.numBins << ", \"chunks\": " << profile.numChunks
+           << ", \"compressed_bytes\": " << profile.bytesSpanned << ", \"index_bytes\": " << profile.indexBytes;
+}
+
+// -----------------------------------------------------------------------------
+// Function profileBam()
+// -----------------------------------------------------------------------------
+
+template<typename TTag>
+int profileBam(CharString const & indexfile, ProfileOptions const & options, TTag)
+{
+    BamIndex<TTag> index;
+    ContigDictionary refNames;
+    bool indexLoaded = false;
+    bool readFailed = false;
+
+    SEQAN_OMP_PRAGMA(parallel sections num_threads(2))
+    {
+        SEQAN_OMP_PRAGMA(section)
+        indexLoaded = open(index, toCString(indexfile));
+
+        SEQAN_OMP_PRAGMA(section)
+        readFailed = readContigs(refNames, options.contigsFile, options.bamfile) != 0;
+    }
+
+    if (readFailed)
+        return 1;
+    if (!indexLoaded)
+    {
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
+    }
+    if (length(index._binIndices) != length(refNames.names))
+    {
+        std::cerr << "ERROR: Number of references in " << indexfile << " does not match the bam header." << std::endl;
+        return 1;
+    }
+
+    String<Pair<__uint32, __uint32> > binRanges;
+    String<Pair<__uint64, __uint64> > ranges;
+    std::ostringstream out(std::ios::binary | std::ios::out);
+    IntervalProfile profile;
+
+    if (options.json)
+        std::cout << "{\n  \"window\": " << options.windowSize << ",\n  \"references\": [\n";
+    else
+        std::cout << "#type\treference\tbegin\tend\tbins\tchunks\tcompressed_bytes\tindex_bytes\n";
+
+    for (unsigned chrId = 0; chrId < length(refNames.names); ++chrId)
+    {
+        __uint32 refLength = refNames.lengths[chrId];
+
+        GenomicInterval interval;
+        interval.chrId = chrId;
+        interval.begin = 0;
+        interval.end = refLength;
+        profileInterval(profile, binRanges, ranges, out, index, interval, options);
+        printProfile(std::cout, "reference", refNames.names[chrId], 0, refLength, profile, options.json);
+        if (options.json)
+            std::cout << ", \"windows\": [\n";
+
+        for (__uint64 beg = 0; beg < refLength; beg += options.windowSize)
+        {
+            interval.begin = beg;
+            interval.end = _min(beg + options.windowSize, (__uint64)refLength);
+            profileInterval(profile, binRanges, ranges, out, index, interval, options);
+            printProfile(std::cout, "window", refNames.names[chrId], interval.begin, interval.end, profile, options.json);
+            if (options.json)
+                std::cout << (interval.end < refLength ? "},\n" : "}\n");
+        }
+
+        if (options.json)
+            std::cout << "    ]}" << (chrId + 1 < length(refNames.names) ? ",\n" : "\n");
+    }
+
+    if (options.json)
+        std::cout << "  ]\n}\n";
+
+    return std::cout.good() ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function profileMain()
+// -----------------------------------------------------------------------------
+
+// Entry point of 'chopBAI profile'. The arguments start with the subcommand.
+
+int profileMain(int argc, char const ** argv)
+{
+    ProfileOptions options;
+    ArgumentParser::ParseResult res = parseProfileCommandLine(options, argc, argv);
+    if (res == ArgumentParser::PARSE_HELP || res == ArgumentParser::PARSE_VERSION ||
+        res ==  ArgumentParser::PARSE_WRITE_CTD || res == ArgumentParser::PARSE_EXPORT_HELP)
+        return 0;
+    else if (res != ArgumentParser::PARSE_OK)
+        return 1;
+
+    CharString indexfile;
+    if (findIndexFile(indexfile, options.bamfile) != 0)
+        return 1;
+
+    if (suffix(indexfile, length(indexfile) - 3) == "bai")
+        return profileBam(indexfile, options, Bai());
+    else
+        return profileBam(indexfile, options, Csi());
+}
+
+// -----------------------------------------------------------------------------
+// Function setupViewParser()
+// -----------------------------------------------------------------------------
+
+void setupViewParser(ArgumentParser & parser, ViewOptions & options)
+{
+    setShortDescription(parser, "reads the alignments of regions using a chopped index");
+
+    setVersion(parser, "0.1 beta");
+    setDate(parser, DATE);
+
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
+
+    addDescription(parser, "Writes the alignments overlapping the regions as uncompressed bam file, e.g. for 'samtools view -'. "
+                           "The file ranges of each region are computed from the index up front and read in large batches "
+                           "while the next batch is prefetched; the BGZF blocks of a batch are inflated in parallel. The "
+                           "index is the bai or csi file next to the bam file unless given with -i, e.g. an index written "
+                           "by chopBAI for the region. The regions have the same formats as for chopping.");
+
+    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM-FILE"));
+    addArgument(parser, ArgParseArgument(ArgParseArgument::STRING, "REGIONS", true));
+
+    addSection(parser, "View options");
+    addOption(parser, ArgParseOption("i", "index", "Bai or csi file to use.", ArgParseArgument::INPUT_FILE, "FILE"));
+    setValidValues(parser, "index", "bai csi");
+    addOption(parser, ArgParseOption("o", "output", "Output file.", ArgParseArgument::OUTPUT_FILE, "FILE"));
+    addOption(parser, ArgParseOption("c", "count", "Only print the number of alignments per region."));
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads inflating BGZF blocks.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "threads", "1");
+    addOption(parser, ArgParseOption("r", "readahead", "Compressed megabytes read per batch.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "readahead", "1");
+
+    setDefaultValue(parser, "output", "standard output");
+    setDefaultValue(parser, "count", options.count?"true":"false");
+    setDefaultValue(parser, "threads", options.numThreads);
+    setDefaultValue(parser, "readahead", options.readahead);
+}
+
+// -----------------------------------------------------------------------------
+// Function parseViewCommandLine()
+// -----------------------------------------------------------------------------
+
+ArgumentParser::ParseResult parseViewCommandLine(ViewOptions & options, int argc, char const ** argv)
+{
+    ArgumentParser parser("chopBAI view");
+    setupViewParser(parser, options);
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    getArgumentValue(options.bamfile, parser, 0);
+    options.regions = getArgumentValues(parser, 1);
+    if (isSet(parser, "index"))
+        getOptionValue(options.indexfile, parser, "index");
+    if (isSet(parser, "output"))
+        getOptionValue(options.outputFile, parser, "output");
+    if (isSet(parser, "count"))
+        options.count = true;
+    if (isSet(parser, "threads"))
+        getOptionValue(options.numThreads, parser, "threads");
+    if (isSet(parser, "readahead"))
+        getOptionValue(options.readahead, parser, "readahead");
+
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function viewBam()
+// -----------------------------------------------------------------------------
+
+template<typename TTag>
+int viewBam(CharString const & indexfile, ViewOptions const & options, TTag)
+{
+    BamIndex<TTag> index;
+    ContigDictionary refNames;
+    RegionPlan plan;
+    if (!open(index, toCString(indexfile)))
+    {
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
+    }
+
+    // The reference names are resolved from the header that is written out.
+    RegionReader reader;
+    String<char> header;
+    if (!open(reader, toCString(options.bamfile), options.numThreads, (size_t)options.readahead << 20) ||
+        !readHeader(header, reader))
+    {
+        std::cerr << "ERROR: Could not read the header of " << options.bamfile << std::endl;
+        return 1;
+    }
+    headerContigs(refNames, header);
+    if (parseIntervals(plan, options.regions, refNames) != 0)
+        return 1;
+
+    std::ofstream file;
+    if (!empty(options.outputFile))
+    {
+        file.open(toCString(options.outputFile), std::ios::binary | std::ios::out);
+        if (!file.is_open())
+        {
+            std::cerr << "ERROR: Could not open output file " << options.outputFile << std::endl;
+            return 1;
+        }
+    }
+    std::ostream & out = empty(options.outputFile) ? std::cout : file;
+    if (!options.count)
+        out.write(&header[0], length(header));
+
+    // Stream the alignments of each region.
+    String<char> record;
+    for (unsigned i = 0; i < length(plan.intervals); ++i)
+    {
+        GenomicInterval const & interval = plan.intervals[i];
+        setRegion(reader, index, interval.chrId, interval.begin, interval.end);
+
+        __uint64 numRecords = 0;
+        while (readRecord(record, reader))
+        {
+            ++numRecords;
+            if (!options.count)
+                out.write(&record[0], length(record));
+        }
+        if (reader.error)
+        {
+            std::cerr << "ERROR: Could not read the alignments of region " << plan.regionNames[i] << " from "
+                      << options.bamfile << std::endl;
+            return 1;
+        }
+        if (options.count)
+            out << plan.regionNames[i] << '\t' << numRecords << '\n';
+    }
+
+    out.flush();
+    return out.good() ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Function viewMain()
+// -----------------------------------------------------------------------------
+
+// Entry point of 'chopBAI view'. The arguments start with the subcommand.
+
+int viewMain(int argc, char const ** argv)
+{
+    ViewOptions options;
+    ArgumentParser::ParseResult res = parseViewCommandLine(options, argc, argv);
+    if (res == ArgumentParser::PARSE_HELP || res == ArgumentParser::PARSE_VERSION ||
+        res ==  ArgumentParser::PARSE_WRITE_CTD || res == ArgumentParser::PARSE_EXPORT_HELP)
+        return 0;
+    else if (res != ArgumentParser::PARSE_OK)
+        return 1;
+
+    CharString indexfile = options.indexfile;
+    if (empty(indexfile) && findIndexFile(indexfile, options.bamfile) != 0)
+        return 1;
+
+    if (suffix(indexfile, length(indexfile) - 3) == "bai")
+        return viewBam(indexfile, options, Bai());
+    else
+        return viewBam(indexfile, options, Csi());
+}
+
+// -----------------------------------------------------------------------------
+// Function setupSplitParser()
+// -----------------------------------------------------------------------------
+
+void setupSplitParser(ArgumentParser & parser, SplitOptions & options)
+{
+    setShortDescription(parser, "writes one index per reference");
+
+    setVersion(parser, "0.1 beta");
+    setDate(parser, DATE);
+
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP");
+
+    addDescription(parser, "Writes the same index for each reference as chopping the region 'chr' for all references, "
+                           "to \'<output prefix>/<reference>/<bamfile>.[bai|csi]\'. The bai or csi file is read once "
+                           "sequentially and the index of each reference is written and released as soon as it is "
+                           "read, so that only about one reference of the index is held in memory.");
+
+    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM-FILE"));
+
+    addSection(parser, "Output options");
+    addOption(parser, ArgParseOption("p", "prefix", "Output prefix.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("l", "linear", "Include linear index of BAI in the output."));
+    addOption(parser, ArgParseOption("s", "symlink", "Create a symbolic link to the bam file in the output directory."));
+    addOption(parser, ArgParseOption("f", "fan-out", "Distribute the reference directories over a two-level directory "
+                                                     "layout as for chopping."));
+    addOption(parser, ArgParseOption("", "io-uring", "Write the output files in batches of io_uring operations on Linux."));
+
+    addSection(parser, "Input options");
+    addOption(parser, ArgParseOption("c", "contigs", "Read the reference names from a .fai or .dict file instead of the "
+                                                     "bam header.", ArgParseArgument::INPUT_FILE, "FILE"));
+    setValidValues(parser, "contigs", "fai dict");
+
+    setDefaultValue(parser, "prefix", "current directory");
+    setDefaultValue(parser, "linear", options.writeLinear?"true":"false");
+    setDefaultValue(parser, "symlink", options.createSymlink?"true":"false");
+    setDefaultValue(parser, "fan-out", options.fanOut?"true":"false");
+    setDefaultValue(parser, "io-uring", options.ioUring?"true":"false");
+}
+
+// -----------------------------------------------------------------------------
+// Function parseSplitCommandLine()
+// -----------------------------------------------------------------------------
+
+ArgumentParser::ParseResult parseSplitCommandLine(SplitOptions & options, int argc, char const ** argv)
+{
+    ArgumentParser parser("chopBAI split");
+    setupSplitParser(parser, options);
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    getArgumentValue(options.bamfile, parser, 0);
+    if (isSet(parser, "prefix"))
+        getOptionValue(options.outputPrefix, parser, "prefix");
+    if (isSet(parser, "linear"))
+        options.writeLinear = true;
+    if (isSet(parser, "symlink"))
+        options.createSymlink = true;
+    if (isSet(parser, "fan-out"))
+        options.fanOut = true;
+    if (isSet(parser, "io-uring"))
+        options.ioUring = true;
+    if (isSet(parser, "contigs"))
+        getOptionValue(options.contigsFile, parser, "contigs");
+
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function canSplitReference()
+// -----------------------------------------------------------------------------
+
+// Returns true if reference refId can be cropped from the first numRefs references.
+// Cropping a BAI reference without linear index takes the first offset from the
+// linear indices of the following references.
+
+bool canSplitReference(BamIndex<Bai> const & index, size_t refId, size_t numRefs)
+{
+    if (numRefs == length(index._linearIndices) || !empty(index._linearIndices[refId]))
+        return true;
+
+    for (size_t i = refId + 1; i < numRefs; ++i)
+        for (unsigned j = 0; j < length(index._linearIndices[i]); ++j)
+            if (index._linearIndices[i][j] != 0u)
+                return true;
+    return false;
+}
+
+bool canSplitReference(BamIndex<Csi> const & /*index*/, size_t /*refId*/, size_t /*numRefs*/)
+{
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Function releaseReference()
+// -----------------------------------------------------------------------------
+
+void releaseReference(BamIndex<Bai> & index, size_t refId)
+{
+    index._binIndices[refId].clear();
+    clear(index._linearIndices[refId]);
+    shrinkToFit(index._linearIndices[refId]);
+}
+
+void releaseReference(BamIndex<Csi> & index, size_t refId)
+{
+    index._binIndices[refId].clear();
+}
+
+// -----------------------------------------------------------------------------
+// Function splitReferences()
+// -----------------------------------------------------------------------------
+
+// Writes the index of each of the first numRefs references that is not written
+// yet and can be cropped, in order of the references.
+
+template<typename TTag>
+void splitReferences(ReferenceSplit<TTag> & split, size_t numRefs)
+{
+    if (!split.ok)
+        return;
+    if (length(split.inIndex._binIndices) != length(split.refNames.names))
+    {
+        std::cerr << "ERROR: Number of references in the bam index does not match the bam header." << std::endl;
+        split.ok = false;
+        return;
+    }
+
+    for (; split.numWritten < numRefs && canSplitReference(split.inIndex, split.numWritten, numRefs); ++split.numWritten)
+    {
+        GenomicInterval interval;
+        interval.chrId = split.numWritten;
+        interval.begin = 0;
+        interval.end = MaxValue<__uint32>::VALUE;
+        getCandidateBinRanges(split.binRanges, interval.begin, interval.end, split.inIndex);
+        cropInterval(split.outIndex, split.inIndex, interval, split.binRanges, split.options.writeLinear);
+
+        split.out.str("");
+        if (!saveIndex(split.outIndex, split.out) ||
+            !writeRegion(split.writer, split.refNames.names[interval.chrId], split.out.str()))
         {
-            std::cout << "  Bin " << it->first << ", loffset " << (it->second).loffset << " has " << length((it->second).chunkBegEnds) << " chunks." << std::endl;
-            for (unsigned j = 0; j < length((it->second).chunkBegEnds); ++j)
-                std::cout << "    chunkBeg: " << (it->second).chunkBegEnds[j].i1
-                          << ", chunkEnd: " << (it->second).chunkBegEnds[j].i2
-                          << ", diff: " << ((it->second).chunkBegEnds[j].i2 - (it->second).chunkBegEnds[j].i1) << std::endl;
+            split.ok = false;
+            return;
         }
-        std::cout << std::endl;
+
+        releaseReference(split.outIndex, interval.chrId);
+        releaseReference(split.inIndex, interval.chrId);
     }
 }
 
+// -----------------------------------------------------------------------------
+// Function splitBam()
 // -----------------------------------------------------------------------------
 
-void printBamIndex(BamIndex<Bai> & bai)
+template<typename TTag>
+int splitBam(CharString const & indexfile, SplitOptions const & options, TTag)
 {
-    std::cout << "Length of bin indices: " << length(bai._binIndices) << std::endl;
-    std::cout << "Length of linear indices: " << length(bai._linearIndices) << std::endl;
-    std::cout << std::endl;
+    ContigDictionary refNames;
+    if (readContigs(refNames, options.contigsFile, options.bamfile) != 0)
+        return 1;
 
-    for (unsigned i = 0; i < length(bai._binIndices); ++i)
+    OutputWriter writer;
+    if (!open(writer, options.outputPrefix, indexfile, options.bamfile, options.createSymlink, options.fanOut,
+              options.ioUring))
+        return 1;
+
+    // Read the index and write each reference on the way.
+    BamIndex<TTag> inIndex;
+    ReferenceSplit<TTag> split(inIndex, writer, refNames, options);
+    bool indexLoaded = open(inIndex, toCString(indexfile), split);
+    if (indexLoaded && split.ok)
+        splitReferences(split, length(inIndex._binIndices));
+    if (!flush(writer))
+        split.ok = false;
+    close(writer);
+
+    if (!indexLoaded)
     {
-        if (bai._binIndices[i].size() == 0) continue;
-        std::cout << "Bin index " << i << " has size " << bai._binIndices[i].size() << std::endl;
-        for (BamIndex<Bai>::TBinIndex_::iterator it = bai._binIndices[i].begin(); it != bai._binIndices[i].end(); ++it)
-        {
-            std::cout << "  Bin " << it->first << " has " << length((it->second).chunkBegEnds) << " chunks." << std::endl;
-            for (unsigned j = 0; j < length((it->second).chunkBegEnds); ++j)
-                std::cout << "    chunkBeg: " << (it->second).chunkBegEnds[j].i1
-                          << ", chunkEnd: " << (it->second).chunkBegEnds[j].i2
-                          << ", diff: " << ((it->second).chunkBegEnds[j].i2 - (it->second).chunkBegEnds[j].i1) << std::endl;
-        }
-        std::cout << std::endl;
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
     }
+    return split.ok ? 0 : 1;
+}
 
-    for (unsigned i = 0; i < length(bai._linearIndices); ++i)
+// -----------------------------------------------------------------------------
+// Function splitMain()
+// -----------------------------------------------------------------------------
+
+// Entry point of 'chopBAI split'. The arguments start with the subcommand.
+
+int splitMain(int argc, char const ** argv)
+{
+    SplitOptions options;
+    ArgumentParser::ParseResult res = parseSplitCommandLine(options, argc, argv);
+    if (res == ArgumentParser::PARSE_HELP || res == ArgumentParser::PARSE_VERSION ||
+        res ==  ArgumentParser::PARSE_WRITE_CTD || res == ArgumentParser::PARSE_EXPORT_HELP)
+        return 0;
+    else if (res != ArgumentParser::PARSE_OK)
+        return 1;
+
+    CharString indexfile;
+    if (findIndexFile(indexfile, options.bamfile) != 0)
+        return 1;
+
+    if (suffix(indexfile, length(indexfile) - 3) == "bai")
+        return splitBam(indexfile, options, Bai());
+    else
+        return splitBam(indexfile, options, Csi());
+}
+
+// -----------------------------------------------------------------------------
+// Function setupCountParser()
+// -----------------------------------------------------------------------------
+
+void setupCountParser(ArgumentParser & parser, CountOptions & options)
+{
+    setShortDescription(parser, "estimates the number of reads of regions from a bam index");
+
+    setVersion(parser, "0.1 beta");
+    setDate(parser, DATE);
+
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION1\\fP [... \\fIREGIONn\\fP]");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM-FILE\\fP \\fIREGION-FILE\\fP");
+
+    addDescription(parser, "Reports the number of mapped reads and of unmapped reads placed on each reference sequence "
+                           "as stored in the metabins of the bai or csi file, the number of reads without coordinate, "
+                           "and an estimate of both numbers for each region. No alignments are read. The estimate "
+                           "spreads the reads of a reference over its compressed bytes in the bam file and counts the "
+                           "bytes between the file offsets of the region's endpoints, which are interpolated between "
+                           "the offsets of the 16 kb windows in the index. The regions have the same formats as for "
+                           "chopping. The report is written to standard output; positions are 1-based and both "
+                           "endpoints are included. Counts that the index does not hold are reported as NA.");
+
+    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM-FILE"));
+    addArgument(parser, ArgParseArgument(ArgParseArgument::STRING, "REGIONS", true));
+
+    addSection(parser, "Count options");
+    addOption(parser, ArgParseOption("c", "contigs", "Read the reference names and lengths from a .fai or .dict file "
+                                                     "instead of the bam header.", ArgParseArgument::INPUT_FILE, "FILE"));
+    setValidValues(parser, "contigs", "fai dict");
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads estimating the regions' counts.",
+                                     ArgParseArgument::INTEGER, "INT"));
+    setMinValue(parser, "threads", "1");
+
+    setDefaultValue(parser, "threads", options.numThreads);
+}
+
+// -----------------------------------------------------------------------------
+// Function parseCountCommandLine()
+// -----------------------------------------------------------------------------
+
+ArgumentParser::ParseResult parseCountCommandLine(CountOptions & options, int argc, char const ** argv)
+{
+    ArgumentParser parser("chopBAI count");
+    setupCountParser(parser, options);
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    getArgumentValue(options.bamfile, parser, 0);
+    options.regions = getArgumentValues(parser, 1);
+    if (isSet(parser, "contigs"))
+        getOptionValue(options.contigsFile, parser, "contigs");
+    if (isSet(parser, "threads"))
+        getOptionValue(options.numThreads, parser, "threads");
+
+    return res;
+}
+
+// -----------------------------------------------------------------------------
+// Function referenceCounts()
+// -----------------------------------------------------------------------------
+
+// Reads the file range and the read counts of a reference from its metabin.
+
+template<typename TTag>
+void referenceCounts(ReferenceCounts & counts, BamIndex<TTag> const & index, size_t refId)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+
+    counts = ReferenceCounts();
+    TBinIndex const & binIndex = index._binIndices[refId];
+    typename TBinIndex::const_iterator it = binIndex.find(metaBin(index));
+    if (it == binIndex.end() || length(it->second.chunkBegEnds) < 2)
+        return;
+
+    counts.known = true;
+    counts.begOffset = it->second.chunkBegEnds[0].i1;
+    counts.endOffset = it->second.chunkBegEnds[0].i2;
+    counts.mapped = it->second.chunkBegEnds[1].i1;
+    counts.unmapped = it->second.chunkBegEnds[1].i2;
+}
+
+// -----------------------------------------------------------------------------
+// Function offsetBreakpoints()
+// -----------------------------------------------------------------------------
+
+// Collects the file offsets of the first alignments of the windows of a reference
+// as (position, offset) pairs in increasing order, starting with the beginning
+// and ending with the end of the reference's file range. The windows are those
+// of the linear index of a BAI and the bins on the deepest level of a CSI.
+
+void _appendBreakpoint(String<Pair<__uint64, __uint64> > & breakpoints, __uint64 pos, __uint64 offset,
+                       ReferenceCounts const & counts)
+{
+    offset = _max(_min(offset, counts.endOffset), back(breakpoints).i2);
+    if (back(breakpoints).i1 == pos)
+        back(breakpoints).i2 = offset;
+    else
+        appendValue(breakpoints, Pair<__uint64, __uint64>(pos, offset));
+}
+
+void offsetBreakpoints(String<Pair<__uint64, __uint64> > & breakpoints, BamIndex<Bai> const & index, size_t refId,
+                       ReferenceCounts const & counts, __uint64 refLength)
+{
+    clear(breakpoints);
+    appendValue(breakpoints, Pair<__uint64, __uint64>(0u, counts.begOffset));
+
+    String<__uint64> const & linearIndex = index._linearIndices[refId];
+    for (unsigned i = 0; i < length(linearIndex) && ((__uint64)i << 14) < refLength; ++i)
+        if (linearIndex[i] != 0u)
+            _appendBreakpoint(breakpoints, (__uint64)i << 14, linearIndex[i], counts);
+
+    __uint64 endPos = _min((__uint64)length(linearIndex) << 14, refLength);
+    _appendBreakpoint(breakpoints, _max(endPos, back(breakpoints).i1 + 1), counts.endOffset, counts);
+}
+
+void offsetBreakpoints(String<Pair<__uint64, __uint64> > & breakpoints, BamIndex<Csi> const & index, size_t refId,
+                       ReferenceCounts const & counts, __uint64 refLength)
+{
+    typedef BamIndex<Csi>::TBinIndex_ TBinIndex;
+
+    clear(breakpoints);
+    appendValue(breakpoints, Pair<__uint64, __uint64>(0u, counts.begOffset));
+
+    TBinIndex const & binIndex = index._binIndices[refId];
+    __uint32 firstBin = levelFirstBin(index._depth);
+    __uint64 endPos = 0;
+    for (TBinIndex::const_iterator it = binIndex.lower_bound(firstBin); it != binIndex.end() && it->first < metaBin(index);
+         ++it)
     {
-        if (length(bai._linearIndices[i]) == 0) continue;
-        std::cout << "Linear index " << i << " has size " << length(bai._linearIndices[i]) << std::endl;
-        for (unsigned j = _max(0, (int)length(bai._linearIndices[i])-100); j < length(bai._linearIndices[i]); ++j)
-            std::cout << "  " << j << "/" << length(bai._linearIndices[i]) << ": " << bai._linearIndices[i][j] << std::endl;
-        std::cout << std::endl;
+        __uint64 pos = (__uint64)(it->first - firstBin) << index._minShift;
+        if (pos >= refLength)
+            break;
+        _appendBreakpoint(breakpoints, pos, it->second.loffset, counts);
+        endPos = pos + (1u << index._minShift);
     }
+
+    endPos = _min(endPos, refLength);
+    _appendBreakpoint(breakpoints, _max(endPos, back(breakpoints).i1 + 1), counts.endOffset, counts);
 }
 
+// -----------------------------------------------------------------------------
+// Function virtualPosition()
+// -----------------------------------------------------------------------------
+
+// Converts a virtual file offset into an approximate position in uncompressed
+// bytes, given the number of uncompressed bytes per compressed byte.
+
+inline double virtualPosition(__uint64 offset, double scale)
+{
+    return (offset >> 16) * scale + (offset & 0xffff);
+}
 
 // -----------------------------------------------------------------------------
-// Function saveIndex()
+// Function interpolatePosition()
 // -----------------------------------------------------------------------------
 
-bool saveIndex(BamIndex<Bai> const & index, char const * filename)
+// Returns the virtual position of the first alignment at pos, interpolated between
+// the breakpoints before and after pos.
+
+double interpolatePosition(String<Pair<__uint64, __uint64> > const & breakpoints, __uint64 pos, double scale)
 {
-    // Open output file.
-    std::ofstream out(filename, std::ios::binary | std::ios::out);
-    if (!out.is_open())
+    // Find the first breakpoint behind pos; the first breakpoint is at position 0.
+    size_t lo = 1, hi = length(breakpoints);
+    while (lo < hi)
     {
-        std::cerr << "ERROR: Could not open output file: " << filename << std::endl;
-        return 1;
+        size_t mid = lo + (hi - lo) / 2;
+        if (breakpoints[mid].i1 <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    if (lo == length(breakpoints))
+        return virtualPosition(back(breakpoints).i2, scale);
+
+    Pair<__uint64, __uint64> const & prev = breakpoints[lo - 1];
+    Pair<__uint64, __uint64> const & next = breakpoints[lo];
+    double p0 = virtualPosition(prev.i2, scale);
+    double p1 = virtualPosition(next.i2, scale);
+    return p0 + (p1 - p0) * (pos - prev.i1) / (next.i1 - prev.i1);
+}
 
-    SEQAN_ASSERT_EQ(length(index._binIndices), length(index._linearIndices));
+// -----------------------------------------------------------------------------
+// Function compressionScale()
+// -----------------------------------------------------------------------------
 
-    // Write header.
-    out.write("BAI\1", 4);
-    __int32 numRefSeqs = length(index._binIndices);
-    out.write(reinterpret_cast<char *>(&numRefSeqs), 4);
+// Estimates the uncompressed bytes per compressed byte of the bam file from the
+// references' file ranges and read counts. The bytes per read are measured on the
+// references within a single bgzf block, whose ranges are in uncompressed bytes.
+// Without such references, the median distance between neighbouring distinct
+// block offsets of the chunks is taken as the size of a block of 64 kb of data.
 
-    // Write out indices.
-    typedef BamIndex<Bai> const                TBamIndex;
-    typedef TBamIndex::TBinIndex_ const        TBinIndex;
-    typedef TBinIndex::const_iterator          TBinIndexIter;
-    typedef TBamIndex::TLinearIndex_           TLinearIndex;
-    for (int i = 0; i < numRefSeqs; ++i)
-    {
-        TBinIndex const & binIndex = index._binIndices[i];
-        TLinearIndex const & linearIndex = index._linearIndices[i];
+template<typename TTag>
+double compressionScale(BamIndex<TTag> const & index, String<ReferenceCounts> const & refCounts)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator  TBinIter;
 
-        // Write out binning index.
-        __int32 numBins = binIndex.size();
-        out.write(reinterpret_cast<char *>(&numBins), 4);
-        for (TBinIndexIter itB = binIndex.begin(), itBEnd = binIndex.end(); itB != itBEnd; ++itB)
+    double blockBytes = 0, blockReads = 0;          // References within one block.
+    double compressed = 0, uncompressed = 0, reads = 0;  // References over several blocks.
+    for (unsigned i = 0; i < length(refCounts); ++i)
+    {
+        ReferenceCounts const & counts = refCounts[i];
+        if (!counts.known || counts.endOffset <= counts.begOffset)
+            continue;
+        __uint64 numBlocks = (counts.endOffset >> 16) - (counts.begOffset >> 16);
+        if (numBlocks == 0)
         {
-            // Write out bin id.
-            out.write(reinterpret_cast<char const *>(&itB->first), 4);
-
-            // Write out number of chunks.
-            __uint32 numChunks = length(itB->second.chunkBegEnds);
-            out.write(reinterpret_cast<char *>(&numChunks), 4);
+            blockBytes += (counts.endOffset & 0xffff) - (counts.begOffset & 0xffff);
+            blockReads += counts.mapped + counts.unmapped;
+        }
+        else
+        {
+            compressed += numBlocks;
+            uncompressed += (double)(counts.endOffset & 0xffff) - (counts.begOffset & 0xffff);
+            reads += counts.mapped + counts.unmapped;
+        }
+    }
+    if (blockReads > 0 && compressed > 0 && blockBytes / blockReads * reads > uncompressed + compressed)
+        return (blockBytes / blockReads * reads - uncompressed) / compressed;
 
-            // Write out all chunks.
-            typedef Iterator<String<Pair<__uint64> > const, Rooted>::Type TChunkIter;
-            for (TChunkIter itC = begin(itB->second.chunkBegEnds); !atEnd(itC); goNext(itC))
+    std::vector<__uint64> blocks;
+    for (unsigned i = 0; i < length(index._binIndices); ++i)
+    {
+        for (TBinIter it = index._binIndices[i].begin(); it != index._binIndices[i].end(); ++it)
+        {
+            if (it->first == metaBin(index))
+                continue;
+            for (unsigned j = 0; j < length(it->second.chunkBegEnds); ++j)
             {
-                out.write(reinterpret_cast<char const *>(&itC->i1), 8);
-                out.write(reinterpret_cast<char const *>(&itC->i2), 8);
+                blocks.push_back(it->second.chunkBegEnds[j].i1 >> 16);
+                blocks.push_back(it->second.chunkBegEnds[j].i2 >> 16);
             }
         }
-
-        // Write out linear index.
-        __int32 numIntervals = length(linearIndex);
-        out.write(reinterpret_cast<char *>(&numIntervals), 4);
-        typedef Iterator<String<__uint64> const, Rooted>::Type TLinearIndexIter;
-        for (TLinearIndexIter it = begin(linearIndex, Rooted()); !atEnd(it); goNext(it))
-            out.write(reinterpret_cast<char const *>(&*it), 8);
     }
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    if (blocks.size() < 2)
+        return 1.0;
+
+    std::vector<__uint64> gaps(blocks.size() - 1);
+    for (size_t i = 0; i + 1 < blocks.size(); ++i)
+        gaps[i] = blocks[i + 1] - blocks[i];
+    std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+    return 65536.0 / gaps[gaps.size() / 2];
+}
 
-    // Write the number of unaligned reads if set.
-    if (index._unalignedCount != maxValue<__uint64>())
-        out.write(reinterpret_cast<char const *>(&index._unalignedCount), 8);
+// -----------------------------------------------------------------------------
+// Function printCounts()
+// -----------------------------------------------------------------------------
 
-    return out.good();  // false on error, true on success.
+void printCounts(std::ostream & stream, char const * type, CharString const & refName, __uint64 beg, __uint64 end,
+                 bool known, __uint64 mapped, __uint64 unmapped, __uint64 numBytes)
+{
+    stream << type << '\t' << refName << '\t' << beg << '\t' << end << '\t';
+    if (known)
+        stream << mapped << '\t' << unmapped << '\t' << numBytes << '\n';
+    else
+        stream << "NA\tNA\tNA\n";
 }
 
-
 // -----------------------------------------------------------------------------
-// Function chopIndex()
+// Function countBam()
 // -----------------------------------------------------------------------------
 
+// Reports the exact counts of the references and the estimates for the regions,
+// which are computed in parallel.
+
 template<typename TTag>
-int chopIndex(String<GenomicInterval> & intervals, CharString & indexfile, ChopBaiOptions & options, TTag)
+int countBam(CharString const & indexfile, CountOptions const & options, TTag)
 {
-    // Load the input bam index.
-    BamIndex<TTag> inIndex;
-    if (open(inIndex, toCString(indexfile)) != true)
+    BamIndex<TTag> index;
+    ContigDictionary refNames;
+    bool indexLoaded = false;
+    bool readFailed = false;
+
+    SEQAN_OMP_PRAGMA(parallel sections num_threads(2))
     {
-        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
-        return 1;
+        SEQAN_OMP_PRAGMA(section)
+        indexLoaded = open(index, toCString(indexfile));
+
+        SEQAN_OMP_PRAGMA(section)
+        readFailed = readContigs(refNames, options.contigsFile, options.bamfile) != 0;
     }
 
-    // Crop the filename from the path of the index file.
-    size_t i = length(indexfile);
-    while (i > 0u)
+    if (readFailed)
+        return 1;
+    if (!indexLoaded)
     {
-        --i;
-        if (indexfile[i] == '/') break;
+        std::cerr << "ERROR: Open failed on bam index file " << indexfile << std::endl;
+        return 1;
     }
-    CharString indexfilename = suffix(indexfile, i);
-
-    // Iterate regions.
-    for (unsigned i = 0; i < length(intervals); ++i)
+    if (length(index._binIndices) != length(refNames.names))
     {
-        // Crop the region from the input bam index.
-        BamIndex<TTag> outIndex;
-        cropInterval(outIndex, inIndex, intervals[i], options.writeLinear);
+        std::cerr << "ERROR: Number of references in " << indexfile << " does not match the bam header." << std::endl;
+        return 1;
+    }
 
-        // Create output directory if not exists.
-        std::stringstream outdir;
-        outdir << options.outputPrefix << "/" << options.regions[i];
-        mkdir(toCString(outdir.str()), 0755);
+    RegionPlan plan;
+    if (parseIntervals(plan, options.regions, refNames) != 0)
+        return 1;
 
-        std::stringstream outfile;
-        outfile << outdir.str() << "/" << indexfilename;
+    // Read the counts of the references and the offsets of their windows.
+    int numRefs = length(refNames.names);
+    String<ReferenceCounts> refCounts;
+    String<String<Pair<__uint64, __uint64> > > breakpoints;
+    resize(refCounts, numRefs);
+    resize(breakpoints, numRefs);
 
-        // Write the output bam index for the region.
-        if (!saveIndex(outIndex, toCString(outfile.str())))
-            return 1;
+    SEQAN_OMP_PRAGMA(parallel for schedule(dynamic, 1) num_threads(options.numThreads))
+    for (int i = 0; i < numRefs; ++i)
+    {
+        referenceCounts(refCounts[i], index, i);
+        if (refCounts[i].known)
+            offsetBreakpoints(breakpoints[i], index, i, refCounts[i], refNames.lengths[i]);
+    }
+    double scale = compressionScale(index, refCounts);
 
-        // Create a symbolic link to the bam file if wished.
-        if (options.createSymlink)
-        {
-            char buf[10240];
-            if (getcwd(buf, 10240) == 0) {
-              std::cerr << "ERROR: could not get current directory?!?" << std::endl;
-              return 1;
-            }
-            CharString linkedbam = buf;
-            linkedbam += "/";
-            linkedbam += prefix(outfile.str(), length(outfile.str()) - 4);
-            if (suffix(linkedbam, length(linkedbam) - 4) != ".bam")
-                linkedbam += ".bam";
+    // Spread the reads of each reference over the bytes of its file range.
+    int numRegions = length(plan.intervals);
+    String<RegionCounts> regionCounts;
+    resize(regionCounts, numRegions);
 
+    SEQAN_OMP_PRAGMA(parallel for schedule(dynamic, 256) num_threads(options.numThreads))
+    for (int i = 0; i < numRegions; ++i)
+    {
+        GenomicInterval const & interval = plan.intervals[i];
+        ReferenceCounts const & counts = refCounts[interval.chrId];
+        __uint64 refLength = refNames.lengths[interval.chrId];
+        if (!counts.known || interval.begin >= _min((__uint64)interval.end, refLength))
+            continue;
+
+        double beg = interpolatePosition(breakpoints[interval.chrId], interval.begin, scale);
+        double end = interpolatePosition(breakpoints[interval.chrId], _min((__uint64)interval.end, refLength), scale);
+        double refBeg = virtualPosition(counts.begOffset, scale);
+        double refEnd = virtualPosition(counts.endOffset, scale);
+        double fraction = (refEnd > refBeg) ? (end - beg) / (refEnd - refBeg) : 1.0;
+
+        regionCounts[i].mapped = (__uint64)(counts.mapped * fraction + 0.5);
+        regionCounts[i].unmapped = (__uint64)(counts.unmapped * fraction + 0.5);
+        regionCounts[i].numBytes = (__uint64)((end - beg) / scale + 0.5);
+    }
 
-            CharString origbam = buf;
-            origbam += "/";
-            origbam += options.bamfile;
-            symlink(toCString(origbam), toCString(linkedbam));
-        }
+    // Write the report.
+    unsigned numUnknown = 0;
+    std::cout << "#type\treference\tbegin\tend\tmapped\tunmapped\tcompressed_bytes\n";
+    for (int i = 0; i < numRefs; ++i)
+    {
+        ReferenceCounts const & counts = refCounts[i];
+        printCounts(std::cout, "reference", refNames.names[i], 1, refNames.lengths[i], counts.known, counts.mapped,
+                    counts.unmapped, (counts.endOffset >> 16) - (counts.begOffset >> 16));
+        if (!counts.known && !index._binIndices[i].empty())
+            ++numUnknown;
+    }
+    printCounts(std::cout, "unplaced", "*", 0, 0, index._unalignedCount != MaxValue<__uint64>::VALUE, 0,
+                index._unalignedCount, 0);
+    for (int i = 0; i < numRegions; ++i)
+    {
+        GenomicInterval const & interval = plan.intervals[i];
+        __uint64 end = _min((__uint64)interval.end, (__uint64)refNames.lengths[interval.chrId]);
+        printCounts(std::cout, "region", refNames.names[interval.chrId], interval.begin + 1, end,
+                    refCounts[interval.chrId].known, regionCounts[i].mapped, regionCounts[i].unmapped,
+                    regionCounts[i].numBytes);
     }
 
-    return 0;
+    if (numUnknown > 0)
+        std::cerr << "WARNING: The index has no metabins with read counts for " << numUnknown << " references with "
+                  << "alignments." << std::endl;
+
+    return std::cout.good() ? 0 : 1;
 }
 
+// -----------------------------------------------------------------------------
+// Function countMain()
+// -----------------------------------------------------------------------------
+
+// Entry point of 'chopBAI count'. The arguments start with the subcommand.
+
+int countMain(int argc, char const ** argv)
+{
+    CountOptions options;
+    ArgumentParser::ParseResult res = parseCountCommandLine(options, argc, argv);
+    if (res == ArgumentParser::PARSE_HELP || res == ArgumentParser::PARSE_VERSION ||
+        res ==  ArgumentParser::PARSE_WRITE_CTD || res == ArgumentParser::PARSE_EXPORT_HELP)
+        return 0;
+    else if (res != ArgumentParser::PARSE_OK)
+        return 1;
+
+    CharString indexfile;
+    if (findIndexFile(indexfile, options.bamfile) != 0)
+        return 1;
 
+    if (suffix(indexfile, length(indexfile) - 3) == "bai")
+        return countBam(indexfile, options, Bai());
+    else
+        return countBam(indexfile, options, Csi());
+}
 
 // -----------------------------------------------------------------------------
 // Function main()
@@ -710,6 +3735,16 @@ int chopIndex(String<GenomicInterval> & intervals, CharString & indexfile, ChopB
 
 int main(int argc, char const ** argv)
 {
+    // Run a subcommand.
+    if (argc > 1 && strcmp(argv[1], "profile") == 0)
+        return profileMain(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "view") == 0)
+        return viewMain(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "split") == 0)
+        return splitMain(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "count") == 0)
+        return countMain(argc - 1, argv + 1);
+
     // Parse command line parameters.
     ChopBaiOptions options;
     ArgumentParser::ParseResult res = parseCommandLine(options, argc, argv);
@@ -719,25 +3754,77 @@ int main(int argc, char const ** argv)
     else if (res != ArgumentParser::PARSE_OK)
         return 1;
 
-    // Parse the regions.
-    String<GenomicInterval> intervals;
-    if (parseIntervals(intervals, options.regions, options.bamfile) != 0)
+    // Chop the index files of all bam files in cohort mode.
+    if (options.bamList && options.watchDir)
+    {
+        std::cerr << "ERROR: Cohort mode and watch mode cannot be combined." << std::endl;
+        return 1;
+    }
+    if ((options.bamList || options.watchDir) && options.rechop)
+    {
+        std::cerr << "ERROR: Re-chopping a reduced index is not available in cohort and watch mode." << std::endl;
+        return 1;
+    }
+    if (options.bamList && options.numShards > 1)
+    {
+        std::cerr << "ERROR: Sharding is not available in cohort mode." << std::endl;
+        return 1;
+    }
+    if (options.rechop && options.addMates)
+    {
+        std::cerr << "ERROR: Adding mates is not available when re-chopping a reduced index." << std::endl;
+        return 1;
+    }
+    if (options.rechop && options.csiMinShift != 0)
+    {
+        std::cerr << "ERROR: Rebuilding the index as CSI is not available when re-chopping a reduced index." << std::endl;
+        return 1;
+    }
+    if (options.bamList && options.csiMinShift != 0)
+    {
+        std::cerr << "ERROR: Rebuilding the index as CSI is not available in cohort mode." << std::endl;
+        return 1;
+    }
+    if (options.bamList)
+        return chopCohort(options);
+
+    // Chop the index files written to a directory in watch mode.
+    if (options.watchDir && options.numShards > 1)
+    {
+        std::cerr << "ERROR: Sharding is not available in watch mode." << std::endl;
         return 1;
+    }
+    if (options.watchDir && options.csiMinShift != 0)
+    {
+        std::cerr << "ERROR: Rebuilding the index as CSI is not available in watch mode." << std::endl;
+        return 1;
+    }
+    if (options.watchDir)
+        return chopWatch(options);
 
     // Look for the index file given a BAM file.
     CharString indexfile;
     if (findIndexFile(indexfile, options.bamfile) != 0)
         return 1;
 
+    // Rebuild the index as CSI and chop it.
+    if (options.csiMinShift != 0)
+    {
+        if (suffix(indexfile, length(indexfile) - 3) == "bai")
+            return convertBam(indexfile, options, Bai());
+        else
+            return convertBam(indexfile, options, Csi());
+    }
+
     // Chop the index file.
     if (suffix(indexfile, length(indexfile) - 3) == "bai") // Found BAI file
     {
-        if (chopIndex(intervals, indexfile, options, Bai()) != 0)
+        if (chopBam(indexfile, options, Bai()) != 0)
             return 1;
     }
     else if (suffix(indexfile, length(indexfile) - 3) == "csi") // Found CSI file
     {
-        if (chopIndex(intervals, indexfile, options, Csi()) != 0)
+        if (chopBam(indexfile, options, Csi()) != 0)
             return 1;
     }
 
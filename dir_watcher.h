@@ -0,0 +1,269 @@
+#ifndef CHOPBAI_DIR_WATCHER_H_
+#define CHOPBAI_DIR_WATCHER_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Class DirWatcher
+// ----------------------------------------------------------------------------
+
+// Reports the files of a directory that are closed after writing or moved into
+// it, using inotify. Subdirectories are not watched.
+
+struct DirWatcher
+{
+    int fd;
+    int wd;
+    CharString dir;
+    std::vector<char> buffer;
+    time_t lastRead;           // Time of the last read of events.
+
+    DirWatcher() : fd(-1), wd(-1), lastRead(0)
+    {}
+
+    ~DirWatcher()
+    {
+        if (fd != -1)
+            ::close(fd);
+    }
+
+private:
+    DirWatcher(DirWatcher const &);
+    DirWatcher & operator=(DirWatcher const &);
+};
+
+// ----------------------------------------------------------------------------
+// Class WorkQueue
+// ----------------------------------------------------------------------------
+
+// Files waiting for one of a fixed number of worker threads. A file that is
+// already waiting is not queued twice. A file that is pushed while a worker
+// processes it is queued again when the worker is done with it.
+
+struct WorkQueue
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<CharString> files;
+    std::vector<CharString> running;    // Files taken by workers.
+    std::vector<CharString> rewritten;  // Running files pushed again.
+    bool closed;               // No more files are pushed.
+
+    WorkQueue() : closed(false)
+    {}
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+inline bool
+open(DirWatcher & watcher, CharString const & dir)
+{
+    watcher.fd = ::inotify_init1(IN_CLOEXEC);
+    if (watcher.fd == -1)
+        return false;
+    watcher.wd = ::inotify_add_watch(watcher.fd, toCString(dir), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+    if (watcher.wd == -1)
+        return false;
+
+    watcher.dir = dir;
+    watcher.buffer.resize(64 * 1024);
+    watcher.lastRead = ::time(0);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _filePath()
+// ----------------------------------------------------------------------------
+
+inline CharString
+_filePath(DirWatcher const & watcher, char const * name)
+{
+    CharString path = watcher.dir;
+    if (!empty(path) && back(path) != '/')
+        appendValue(path, '/');
+    path += name;
+    return path;
+}
+
+// ----------------------------------------------------------------------------
+// Function _rescan()
+// ----------------------------------------------------------------------------
+
+// Appends the regular files of the directory that were modified since the given
+// time to files. Used when inotify dropped events.
+
+inline void
+_rescan(String<CharString> & files, DirWatcher const & watcher, time_t since)
+{
+    DIR * dir = ::opendir(toCString(watcher.dir));
+    if (dir == 0)
+        return;
+
+    while (struct dirent * entry = ::readdir(dir))
+    {
+        CharString path = _filePath(watcher, entry->d_name);
+        struct stat st;
+        if (::stat(toCString(path), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= since)
+            appendValue(files, path);
+    }
+    ::closedir(dir);
+}
+
+// ----------------------------------------------------------------------------
+// Function readCompleted()
+// ----------------------------------------------------------------------------
+
+// Waits up to timeout milliseconds for files to be completed in the directory and
+// appends their paths to files. Returns false if the directory can no longer be
+// watched. An interrupting signal returns true without files. If the kernel
+// dropped events, all files modified since the previous read are appended.
+
+inline bool
+readCompleted(String<CharString> & files, DirWatcher & watcher, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = watcher.fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int res = ::poll(&pfd, 1, timeout);
+    if (res <= 0)
+        return res == 0 || errno == EINTR;
+
+    time_t now = ::time(0);
+    ssize_t len = ::read(watcher.fd, &watcher.buffer[0], watcher.buffer.size());
+    if (len < 0)
+        return errno == EINTR || errno == EAGAIN;
+
+    for (ssize_t pos = 0; pos < len; )
+    {
+        struct inotify_event const * event = reinterpret_cast<struct inotify_event const *>(&watcher.buffer[pos]);
+        pos += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & (IN_IGNORED | IN_UNMOUNT))
+            return false;
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            std::cerr << "WARNING: Lost events of directory " << watcher.dir << ", rescanning it." << std::endl;
+            _rescan(files, watcher, watcher.lastRead);
+            continue;
+        }
+        if ((event->mask & IN_ISDIR) || event->len == 0)
+            continue;
+
+        appendValue(files, _filePath(watcher, event->name));
+    }
+    watcher.lastRead = now;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function push()
+// ----------------------------------------------------------------------------
+
+inline void
+push(WorkQueue & queue, CharString const & file)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (std::find(queue.files.begin(), queue.files.end(), file) != queue.files.end())
+            return;
+        if (std::find(queue.running.begin(), queue.running.end(), file) != queue.running.end())
+        {
+            if (std::find(queue.rewritten.begin(), queue.rewritten.end(), file) == queue.rewritten.end())
+                queue.rewritten.push_back(file);
+            return;
+        }
+        queue.files.push_back(file);
+    }
+    queue.changed.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+// Function pop()
+// ----------------------------------------------------------------------------
+
+// Waits for the next file. Returns false once the queue is closed and empty. The
+// worker must call done() when it has processed the file.
+
+inline bool
+pop(CharString & file, WorkQueue & queue)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    while (queue.files.empty() && !queue.closed)
+        queue.changed.wait(lock);
+    if (queue.files.empty())
+        return false;
+
+    file = queue.files.front();
+    queue.files.pop_front();
+    queue.running.push_back(file);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function done()
+// ----------------------------------------------------------------------------
+
+// Marks a file returned by pop() as processed. The file is queued again if it was
+// pushed in the meantime.
+
+inline void
+done(WorkQueue & queue, CharString const & file)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        std::vector<CharString>::iterator it = std::find(queue.running.begin(), queue.running.end(), file);
+        if (it != queue.running.end())
+            queue.running.erase(it);
+        it = std::find(queue.rewritten.begin(), queue.rewritten.end(), file);
+        if (it == queue.rewritten.end())
+            return;
+        queue.rewritten.erase(it);
+        queue.files.push_back(file);
+    }
+    queue.changed.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+// Function close()
+// ----------------------------------------------------------------------------
+
+// Lets the workers finish the waiting files and return.
+
+inline void
+close(WorkQueue & queue)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.closed = true;
+    }
+    queue.changed.notify_all();
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_DIR_WATCHER_H_
@@ -0,0 +1,404 @@
+#ifndef CHOPBAI_INDEX_BUILDER_H_
+#define CHOPBAI_INDEX_BUILDER_H_
+
+#include <algorithm>
+
+#include "index_query.h"
+#include "region_reader.h"
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Helper Class CsiBuildState_
+// ----------------------------------------------------------------------------
+
+// The state of building a CSI while the alignments of a sorted bam file are
+// pushed in file order. Follows hts_idx_push() of htslib, so that the index is
+// the same as written by 'samtools index -c'.
+
+struct CsiBuildState_
+{
+    __int32 minShift;
+    __int32 depth;
+
+    __int32 lastRefId;
+    __int64 lastPos;
+    __uint32 lastBin;          // Bin of the last alignment, NONE at the start of a reference.
+    __uint32 saveBin;          // Bin of the chunk being extended, NONE before the first alignment.
+    __int32 saveRefId;
+    __uint64 saveOffset;       // Start of the chunk being extended.
+    __uint64 refBegOffset;     // Start of the alignments of the current reference.
+    __uint64 numMapped;        // Alignments of the current reference.
+    __uint64 numUnmapped;
+    __uint64 numNoCoord;
+    bool started;
+
+    String<String<__uint64> > linearIndices;  // Offset of the first alignment per window, or the maximal value.
+
+    static const __uint32 NONE = 0xffffffffu;
+
+    CsiBuildState_() :
+        minShift(14), depth(5), lastRefId(-1), lastPos(0), lastBin(NONE), saveBin(NONE), saveRefId(-1),
+        saveOffset(0), refBegOffset(0), numMapped(0), numUnmapped(0), numNoCoord(0), started(false)
+    {}
+};
+
+// ----------------------------------------------------------------------------
+// Helper Class InflatedBlock_
+// ----------------------------------------------------------------------------
+
+// The position of the inflated data of a BGZF block in all inflated data.
+
+struct InflatedBlock_
+{
+    __uint64 dataBeg;
+    __uint64 dataEnd;
+    __uint64 offset;           // File offset of the compressed block.
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _pushAlignment()
+// ----------------------------------------------------------------------------
+
+// Adds the alignment [beg, end) on refId, stored at virtual offset begOffset, to
+// the index. Returns false if the bam file is not sorted or the alignment lies
+// behind the binning.
+
+inline bool
+_pushAlignment(BamIndex<Csi> & index, CsiBuildState_ & state, __int32 refId, __int64 beg, __int64 end,
+               __uint64 begOffset, bool isMapped)
+{
+    if (refId >= (__int32)length(index._binIndices) || end >= ((__int64)1 << (state.minShift + 3 * state.depth)))
+        return false;
+    if (!state.started)
+    {
+        state.refBegOffset = begOffset;
+        state.started = true;
+    }
+
+    if (state.lastRefId != refId)
+    {
+        // The alignments of a reference must be contiguous and followed by the
+        // alignments without coordinate.
+        if (refId >= 0 && (state.numNoCoord > 0 || !index._binIndices[refId].empty()))
+            return false;
+        state.lastRefId = refId;
+        state.lastBin = CsiBuildState_::NONE;
+    }
+    else if (refId >= 0 && state.lastPos > beg)
+    {
+        return false;
+    }
+
+    // Fill the windows of the linear index that the alignment is the first in.
+    // Unmapped alignments with a position do not extend the linear index.
+    __uint32 bin = 0;
+    if (refId >= 0)
+    {
+        if (isMapped)
+        {
+            String<__uint64> & linearIndex = state.linearIndices[refId];
+            size_t lastWindow = (end - 1) >> state.minShift;
+            if (length(linearIndex) <= lastWindow)
+                resize(linearIndex, lastWindow + 1, maxValue<__uint64>());
+            for (size_t w = beg >> state.minShift; w <= lastWindow; ++w)
+                if (linearIndex[w] == maxValue<__uint64>())
+                    linearIndex[w] = begOffset;
+        }
+        bin = _csiReg2bin(beg, end, state.minShift, state.depth);
+    }
+    else
+    {
+        ++state.numNoCoord;
+    }
+
+    // Close the chunk of the previous bin and the metabin of the previous reference.
+    if (state.lastBin != bin)
+    {
+        if (state.saveBin != CsiBuildState_::NONE && state.saveRefId >= 0)
+            appendValue(index._binIndices[state.saveRefId][state.saveBin].chunkBegEnds,
+                        Pair<__uint64, __uint64>(state.saveOffset, begOffset));
+        if (state.lastBin == CsiBuildState_::NONE && state.saveBin != CsiBuildState_::NONE && state.saveRefId >= 0)
+        {
+            String<Pair<__uint64, __uint64> > & meta = index._binIndices[state.saveRefId][metaBin(index)].chunkBegEnds;
+            appendValue(meta, Pair<__uint64, __uint64>(state.refBegOffset, begOffset));
+            appendValue(meta, Pair<__uint64, __uint64>(state.numMapped, state.numUnmapped));
+            state.numMapped = state.numUnmapped = 0;
+            state.refBegOffset = begOffset;
+        }
+        state.saveOffset = begOffset;
+        state.saveBin = state.lastBin = bin;
+        state.saveRefId = refId;
+    }
+
+    if (isMapped)
+        ++state.numMapped;
+    else
+        ++state.numUnmapped;
+    state.lastPos = beg;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _finishReference()
+// ----------------------------------------------------------------------------
+
+// Sets the loffset of the bins of reference refId from its linear index, merges
+// bins spanning less than 64 kb of compressed data into their parents and
+// merges the chunks of a bin that start in the same BGZF block, as
+// hts_idx_finish() of htslib.
+
+inline void
+_finishReference(BamIndex<Csi> & index, CsiBuildState_ & state, size_t refId)
+{
+    typedef BamIndex<Csi>::TBinIndex_ TBinIndex;
+    typedef TBinIndex::iterator       TBinIter;
+
+    TBinIndex & binIndex = index._binIndices[refId];
+    String<__uint64> & linearIndex = state.linearIndices[refId];
+    __uint32 numBins = metaBin(index) - 1;
+
+    // Fill the empty windows with the previous offset or the start of the reference.
+    TBinIter metaIt = binIndex.find(metaBin(index));
+    __uint64 offset = (metaIt != binIndex.end()) ? metaIt->second.chunkBegEnds[0].i1 : 0u;
+    for (size_t w = 0; w < length(linearIndex); ++w)
+    {
+        if (linearIndex[w] == maxValue<__uint64>())
+            linearIndex[w] = offset;
+        offset = linearIndex[w];
+    }
+
+    // The loffset of a bin is the linear index at its first window.
+    for (TBinIter it = binIndex.begin(); it != binIndex.end(); ++it)
+    {
+        it->second.loffset = 0u;
+        if (it->first >= numBins)
+            continue;
+
+        size_t window = binFirstWindow(it->first, state.depth);
+        if (window < length(linearIndex))
+            it->second.loffset = linearIndex[window];
+    }
+    clear(linearIndex);
+    shrinkToFit(linearIndex);
+
+    // Merge small bins into their parents, from the deepest level up.
+    for (__int32 level = state.depth; level > 0; --level)
+    {
+        __uint32 firstBin = levelFirstBin(level);
+        __uint32 lastBin = levelFirstBin(level + 1);
+        for (TBinIter it = binIndex.lower_bound(firstBin); it != binIndex.end() && it->first < lastBin; )
+        {
+            String<Pair<__uint64, __uint64> > & chunks = it->second.chunkBegEnds;
+            std::sort(begin(chunks, Standard()), end(chunks, Standard()));
+            TBinIter parentIt = binIndex.find((it->first - 1) >> 3);
+            if ((back(chunks).i2 >> 16) - (front(chunks).i1 >> 16) >= 65536u || parentIt == binIndex.end())
+            {
+                ++it;
+                continue;
+            }
+            append(parentIt->second.chunkBegEnds, chunks);
+            binIndex.erase(it++);
+        }
+    }
+
+    // Merge the chunks of each bin that start in the block where the previous one ends.
+    for (TBinIter it = binIndex.begin(); it != binIndex.end() && it->first < numBins; ++it)
+    {
+        String<Pair<__uint64, __uint64> > & chunks = it->second.chunkBegEnds;
+        std::sort(begin(chunks, Standard()), end(chunks, Standard()));
+        size_t last = 0;
+        for (size_t i = 1; i < length(chunks); ++i)
+        {
+            if ((chunks[last].i2 >> 16) >= (chunks[i].i1 >> 16))
+                chunks[last].i2 = _max(chunks[last].i2, chunks[i].i2);
+            else
+                chunks[++last] = chunks[i];
+        }
+        resize(chunks, last + 1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Function _virtualOffset()
+// ----------------------------------------------------------------------------
+
+// Returns the virtual offset of position pos in the inflated data. A position at
+// the end of a block belongs to the next block, as reported by bgzf_tell(), and
+// nextOffset is the file offset behind the blocks. The blocks before blockIdx
+// must end at or before pos; blockIdx is advanced.
+
+inline bool
+_blockBefore(InflatedBlock_ const & block, __uint64 pos)
+{
+    return block.dataEnd <= pos && block.dataBeg < pos;
+}
+
+inline __uint64
+_virtualOffset(String<InflatedBlock_> const & blocks, size_t & blockIdx, __uint64 pos, __uint64 nextOffset)
+{
+    while (blockIdx < length(blocks) && _blockBefore(blocks[blockIdx], pos))
+        ++blockIdx;
+    if (blockIdx == length(blocks))
+        return nextOffset << 16;
+    return (blocks[blockIdx].offset << 16) | (pos - blocks[blockIdx].dataBeg);
+}
+
+// ----------------------------------------------------------------------------
+// Function buildCsi()
+// ----------------------------------------------------------------------------
+
+// Builds a CSI with bins of 2^minShift positions on the deepest of depth levels
+// by reading the sorted bam file once. The file is read in batches of readahead
+// bytes whose BGZF blocks are inflated with numThreads threads. Returns false if
+// the file cannot be read, is not sorted or has an alignment behind the binning.
+
+inline bool
+buildCsi(BamIndex<Csi> & index, char const * bamfile, __int32 minShift, __int32 depth, unsigned numThreads,
+         size_t readahead)
+{
+    RegionReader reader;
+    String<char> header;
+    if (!open(reader, bamfile, numThreads, readahead) || !readHeader(header, reader))
+        return false;
+
+    __int32 lText = 0, numRefs = 0;
+    memcpy(&lText, &header[4], 4);
+    memcpy(&numRefs, &header[8 + lText], 4);
+
+    index._minShift = minShift;
+    index._depth = depth;
+    clear(index._aux);
+    clear(index._binIndices);
+    resize(index._binIndices, numRefs);
+
+    CsiBuildState_ state;
+    state.minShift = minShift;
+    state.depth = depth;
+    resize(state.linearIndices, numRefs);
+
+    String<char> data;         // Inflated data not yet scanned, starting at position dataBeg.
+    String<InflatedBlock_> blocks;
+    __uint64 dataBeg = 0;
+    __uint64 pos = length(header);
+    __uint64 offset = 0;       // File offset of the next block to read.
+    while (offset < reader.fileSize)
+    {
+        // Read a batch of complete blocks.
+        size_t toRead = _min((__uint64)reader.readahead, reader.fileSize - offset);
+        resize(reader.compressed, toRead);
+        ssize_t numRead = _readFully(reader.fd, &reader.compressed[0], toRead, offset);
+        if (numRead <= 0)
+            return false;
+
+        clear(reader.blocks);
+        size_t batchPos = 0;
+        while (batchPos + 18 <= (size_t)numRead)
+        {
+            BgzfBlock_ block;
+            block.bufferPos = batchPos;
+            block.size = _bgzfBlockSize(&reader.compressed[batchPos], numRead - batchPos);
+            if (block.size == 0)
+                return false;
+            if (batchPos + block.size > (size_t)numRead)
+                break;
+            appendValue(reader.blocks, block);
+            batchPos += block.size;
+        }
+        if (empty(reader.blocks))
+            return false;  // Truncated file.
+        if (offset + batchPos < reader.fileSize)
+            ::posix_fadvise(reader.fd, offset + batchPos, reader.readahead, POSIX_FADV_WILLNEED);
+
+        // Inflate the blocks.
+        int numBlocks = length(reader.blocks);
+        resize(reader.inflated, (size_t)numBlocks << 16);
+        SEQAN_OMP_PRAGMA(parallel for num_threads(reader.numThreads) schedule(static) if (numBlocks > 1))
+        for (int i = 0; i < numBlocks; ++i)
+        {
+            BgzfBlock_ & block = reader.blocks[i];
+            int size = _inflateBgzfBlock(&reader.inflated[(size_t)i << 16], &reader.compressed[block.bufferPos],
+                                         block.size);
+            block.ok = (size >= 0);
+            block.inflatedSize = _max(size, 0);
+        }
+
+        for (int i = 0; i < numBlocks; ++i)
+        {
+            if (!reader.blocks[i].ok)
+                return false;
+            InflatedBlock_ inflatedBlock;
+            inflatedBlock.dataBeg = dataBeg + length(data);
+            inflatedBlock.dataEnd = inflatedBlock.dataBeg + reader.blocks[i].inflatedSize;
+            inflatedBlock.offset = offset + reader.blocks[i].bufferPos;
+            appendValue(blocks, inflatedBlock);
+            _appendBytes(data, &reader.inflated[(size_t)i << 16], reader.blocks[i].inflatedSize);
+        }
+        offset += batchPos;
+
+        // Push the complete alignments.
+        size_t blockIdx = 0;
+        while (pos + 4 <= dataBeg + length(data))
+        {
+            __int32 blockSize = 0;
+            memcpy(&blockSize, &data[pos - dataBeg], 4);
+            if (blockSize < 32)
+                return false;
+            if (pos + 4 + blockSize > dataBeg + length(data))
+                break;
+
+            char const * record = &data[pos - dataBeg];
+            __int32 refId = 0, beg = 0;
+            __uint16 flag = 0;
+            memcpy(&refId, record + 4, 4);
+            memcpy(&beg, record + 8, 4);
+            memcpy(&flag, record + 18, 2);
+            bool isMapped = !(flag & 4u);
+            __int64 end = isMapped ? _alignmentEnd(record, blockSize, beg) : (__int64)beg + 1;
+            if (end < 0)
+                return false;
+
+            __uint64 begOffset = _virtualOffset(blocks, blockIdx, pos, offset);
+            if (!_pushAlignment(index, state, refId, _max(beg, 0), end, begOffset, isMapped))
+                return false;
+            pos += 4 + blockSize;
+        }
+
+        // Drop the scanned data and blocks.
+        size_t numScanned = _min(pos, dataBeg + length(data)) - dataBeg;
+        erase(data, 0, numScanned);
+        dataBeg += numScanned;
+        erase(blocks, 0, blockIdx);
+    }
+    if (pos != dataBeg + length(data))
+        return false;  // Truncated alignment.
+
+    // Close the last chunk and the metabin of the last reference at the end of
+    // the file, as samtools does.
+    __uint64 endOffset = offset << 16;
+    if (state.saveRefId >= 0 && state.saveBin != CsiBuildState_::NONE)
+    {
+        appendValue(index._binIndices[state.saveRefId][state.saveBin].chunkBegEnds,
+                    Pair<__uint64, __uint64>(state.saveOffset, endOffset));
+        String<Pair<__uint64, __uint64> > & meta = index._binIndices[state.saveRefId][metaBin(index)].chunkBegEnds;
+        appendValue(meta, Pair<__uint64, __uint64>(state.refBegOffset, endOffset));
+        appendValue(meta, Pair<__uint64, __uint64>(state.numMapped, state.numUnmapped));
+    }
+
+    for (__int32 i = 0; i < numRefs; ++i)
+        _finishReference(index, state, i);
+    index._unalignedCount = state.numNoCoord;
+    return true;
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_INDEX_BUILDER_H_
@@ -0,0 +1,500 @@
+#ifndef CHOPBAI_INDEX_CACHE_H_
+#define CHOPBAI_INDEX_CACHE_H_
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// A parsed bam index can be stored in a cache file that is memory mapped by later
+// runs. All sections are arrays of fixed size records in host byte order, aligned
+// to 8 bytes:
+//
+//   IndexCacheHeader_
+//   IndexCacheRef_[numRefs]        bins and linear index entries of each reference
+//   IndexCacheBin_[numBins]        bins of all references, sorted by reference and bin
+//   __uint64[2 * numChunks]        chunk begin and end offsets
+//   __uint64[numLinear]            linear index entries (BAI only)
+//   __uint8[auxLength]             auxiliary data (CSI only), padded to 8 bytes
+//
+// The cache is valid for a bam index with the size and modification time that are
+// recorded in its header.
+
+// ----------------------------------------------------------------------------
+// Helper Class IndexCacheHeader_
+// ----------------------------------------------------------------------------
+
+struct IndexCacheHeader_
+{
+    char magic[8];
+    __uint32 version;
+    __uint32 indexType;        // 0 for BAI, 1 for CSI.
+    __uint64 sourceSize;
+    __int64 sourceMtimeSec;
+    __int64 sourceMtimeNsec;
+    __uint64 unalignedCount;
+    __int32 minShift;
+    __int32 depth;
+    __uint32 numRefs;
+    __uint32 auxLength;
+    __uint64 numBins;
+    __uint64 numChunks;
+    __uint64 numLinear;
+};
+
+// ----------------------------------------------------------------------------
+// Helper Class IndexCacheRef_
+// ----------------------------------------------------------------------------
+
+struct IndexCacheRef_
+{
+    __uint64 firstBin;
+    __uint64 numBins;
+    __uint64 firstLinear;
+    __uint64 numLinear;
+};
+
+// ----------------------------------------------------------------------------
+// Helper Class IndexCacheBin_
+// ----------------------------------------------------------------------------
+
+struct IndexCacheBin_
+{
+    __uint32 bin;
+    __uint32 numChunks;
+    __uint64 firstChunk;
+    __uint64 loffset;
+};
+
+// ----------------------------------------------------------------------------
+// Class IndexCache
+// ----------------------------------------------------------------------------
+
+// A memory mapped cache file of a bam index.
+
+struct IndexCache
+{
+    String<char, MMap<> > file;
+};
+
+static const char INDEX_CACHE_MAGIC[8] = {'C', 'H', 'O', 'P', 'B', 'A', 'I', 'C'};
+static const __uint32 INDEX_CACHE_VERSION = 1;
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _indexCacheType()
+// ----------------------------------------------------------------------------
+
+inline __uint32 _indexCacheType(Bai) { return 0u; }
+inline __uint32 _indexCacheType(Csi) { return 1u; }
+
+// ----------------------------------------------------------------------------
+// Function _indexCachePad()
+// ----------------------------------------------------------------------------
+
+inline __uint64
+_indexCachePad(__uint64 size)
+{
+    return (size + 7u) & ~(__uint64)7u;
+}
+
+// ----------------------------------------------------------------------------
+// Function _indexCacheSize()
+// ----------------------------------------------------------------------------
+
+// Returns the size of a cache file with the counts of the header.
+
+inline __uint64
+_indexCacheSize(IndexCacheHeader_ const & header)
+{
+    return sizeof(IndexCacheHeader_) +
+           header.numRefs * sizeof(IndexCacheRef_) +
+           header.numBins * sizeof(IndexCacheBin_) +
+           header.numChunks * 16u +
+           header.numLinear * 8u +
+           _indexCachePad(header.auxLength);
+}
+
+// ----------------------------------------------------------------------------
+// Function _getBinOffset()
+// ----------------------------------------------------------------------------
+
+inline __uint64 _getBinOffset(BaiBamIndexBinData_ const & /*data*/) { return 0u; }
+inline __uint64 _getBinOffset(CsiBamIndexBinData_ const & data) { return data.loffset; }
+
+inline void _setBinOffset(BaiBamIndexBinData_ & /*data*/, __uint64 /*loffset*/) {}
+inline void _setBinOffset(CsiBamIndexBinData_ & data, __uint64 loffset) { data.loffset = loffset; }
+
+// ----------------------------------------------------------------------------
+// Function _linearIndexLength()
+// ----------------------------------------------------------------------------
+
+inline __uint64
+_linearIndexLength(BamIndex<Bai> const & index, unsigned refId)
+{
+    return length(index._linearIndices[refId]);
+}
+
+inline __uint64
+_linearIndexLength(BamIndex<Csi> const & /*index*/, unsigned /*refId*/)
+{
+    return 0u;
+}
+
+// ----------------------------------------------------------------------------
+// Function _writeLinearIndex()
+// ----------------------------------------------------------------------------
+
+template <typename TStream>
+inline void
+_writeLinearIndex(TStream & out, BamIndex<Bai> const & index, unsigned refId)
+{
+    if (!empty(index._linearIndices[refId]))
+        out.write(reinterpret_cast<char const *>(&index._linearIndices[refId][0]),
+                  length(index._linearIndices[refId]) * 8);
+}
+
+template <typename TStream>
+inline void
+_writeLinearIndex(TStream & /*out*/, BamIndex<Csi> const & /*index*/, unsigned /*refId*/)
+{}
+
+// ----------------------------------------------------------------------------
+// Function _writeIndexCacheAux()
+// ----------------------------------------------------------------------------
+
+template <typename TStream>
+inline void
+_writeIndexCacheAux(TStream & /*out*/, BamIndex<Bai> const & /*index*/)
+{}
+
+template <typename TStream>
+inline void
+_writeIndexCacheAux(TStream & out, BamIndex<Csi> const & index)
+{
+    if (!empty(index._aux))
+        out.write(reinterpret_cast<char const *>(&index._aux[0]), length(index._aux));
+}
+
+// ----------------------------------------------------------------------------
+// Function _setIndexCacheParams()
+// ----------------------------------------------------------------------------
+
+// Copies the parameters of the binning index and the auxiliary data between the
+// cache header and the index.
+
+inline void
+_setIndexCacheParams(IndexCacheHeader_ & header, BamIndex<Bai> const & /*index*/)
+{
+    header.minShift = 14;
+    header.depth = 5;
+    header.auxLength = 0;
+}
+
+inline void
+_setIndexCacheParams(IndexCacheHeader_ & header, BamIndex<Csi> const & index)
+{
+    header.minShift = index._minShift;
+    header.depth = index._depth;
+    header.auxLength = length(index._aux);
+}
+
+inline void
+_getIndexCacheParams(BamIndex<Bai> & /*index*/, IndexCacheHeader_ const & /*header*/, char const * /*aux*/)
+{}
+
+inline void
+_getIndexCacheParams(BamIndex<Csi> & index, IndexCacheHeader_ const & header, char const * aux)
+{
+    index._minShift = header.minShift;
+    index._depth = header.depth;
+    resize(index._aux, header.auxLength);
+    if (header.auxLength > 0u)
+        memcpy(&index._aux[0], aux, header.auxLength);
+}
+
+// ----------------------------------------------------------------------------
+// Function _loadLinearIndices()
+// ----------------------------------------------------------------------------
+
+// Copies the linear indices of all references; they are small and the crop of a
+// BAI looks at the linear indices of the following references.
+
+inline void
+_loadLinearIndices(BamIndex<Bai> & index, IndexCacheRef_ const * refs, __uint64 const * linear, __uint32 numRefs)
+{
+    clear(index._linearIndices);
+    resize(index._linearIndices, numRefs);
+    for (unsigned r = 0; r < numRefs; ++r)
+    {
+        resize(index._linearIndices[r], refs[r].numLinear);
+        if (refs[r].numLinear > 0u)
+            memcpy(&index._linearIndices[r][0], linear + refs[r].firstLinear, refs[r].numLinear * 8);
+    }
+}
+
+inline void
+_loadLinearIndices(BamIndex<Csi> & /*index*/, IndexCacheRef_ const * /*refs*/, __uint64 const * /*linear*/,
+                   __uint32 /*numRefs*/)
+{}
+
+// ----------------------------------------------------------------------------
+// Function fileStat()
+// ----------------------------------------------------------------------------
+
+// Reads the size and modification time of a bam index. Take it before reading the
+// index and pass it to saveIndexCache(), so that a cache of an index that is
+// rewritten meanwhile does not pass for the new index.
+
+inline bool
+fileStat(struct stat & st, char const * fileName)
+{
+    return ::stat(fileName, &st) == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Function checkIndexCache()
+// ----------------------------------------------------------------------------
+
+// Returns true if [data, data + size) is a complete cache of an index of type
+// TTag with the size and modification time in source. The bins, chunks and
+// linear index entries that the references and bins refer to must lie within the
+// cache.
+
+template <typename TTag>
+inline bool
+checkIndexCache(char const * data, __uint64 size, struct stat const & source, TTag)
+{
+    if (size < sizeof(IndexCacheHeader_))
+        return false;
+
+    IndexCacheHeader_ const & header = *reinterpret_cast<IndexCacheHeader_ const *>(data);
+    if (memcmp(header.magic, INDEX_CACHE_MAGIC, 8) != 0 ||
+        header.version != INDEX_CACHE_VERSION ||
+        header.indexType != _indexCacheType(TTag()) ||
+        header.sourceSize != (__uint64)source.st_size ||
+        header.sourceMtimeSec != (__int64)source.st_mtim.tv_sec ||
+        header.sourceMtimeNsec != (__int64)source.st_mtim.tv_nsec)
+        return false;
+
+    // Bound the counts by the file size before computing the size from them.
+    if (header.numRefs > size / sizeof(IndexCacheRef_) || header.numBins > size / sizeof(IndexCacheBin_) ||
+        header.numChunks > size / 16u || header.numLinear > size / 8u || header.auxLength > size ||
+        _indexCacheSize(header) != size)
+        return false;
+
+    IndexCacheRef_ const * refs = reinterpret_cast<IndexCacheRef_ const *>(data + sizeof(IndexCacheHeader_));
+    IndexCacheBin_ const * bins = reinterpret_cast<IndexCacheBin_ const *>(refs + header.numRefs);
+    for (unsigned r = 0; r < header.numRefs; ++r)
+    {
+        if (refs[r].firstBin > header.numBins || refs[r].numBins > header.numBins - refs[r].firstBin ||
+            refs[r].firstLinear > header.numLinear || refs[r].numLinear > header.numLinear - refs[r].firstLinear)
+            return false;
+    }
+    for (__uint64 b = 0; b < header.numBins; ++b)
+    {
+        if (bins[b].firstChunk > header.numChunks || bins[b].numChunks > header.numChunks - bins[b].firstChunk)
+            return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+// Maps the cache file of the bam index indexFileName. Returns false if the cache
+// does not exist or does not belong to the current bam index.
+
+template <typename TTag>
+inline bool
+open(IndexCache & cache, char const * fileName, char const * indexFileName, TTag)
+{
+    struct stat source;
+    if (!fileStat(source, indexFileName) || !open(cache.file, fileName, OPEN_RDONLY))
+        return false;
+
+    if (!checkIndexCache(begin(cache.file, Standard()), length(cache.file), source, TTag()))
+    {
+        close(cache.file);
+        return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function loadIndex()
+// ----------------------------------------------------------------------------
+
+// Fills the index from a valid cache in data. The bins are only filled for the
+// references with refs[r] set, or for all references if refs is empty.
+
+template <typename TTag>
+inline void
+loadIndex(BamIndex<TTag> & index, char const * data, String<bool> const & refs)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::mapped_type     TBinData;
+
+    IndexCacheHeader_ const & header = *reinterpret_cast<IndexCacheHeader_ const *>(data);
+    char const * it = data + sizeof(IndexCacheHeader_);
+    IndexCacheRef_ const * cacheRefs = reinterpret_cast<IndexCacheRef_ const *>(it);
+    it += header.numRefs * sizeof(IndexCacheRef_);
+    IndexCacheBin_ const * cacheBins = reinterpret_cast<IndexCacheBin_ const *>(it);
+    it += header.numBins * sizeof(IndexCacheBin_);
+    __uint64 const * chunks = reinterpret_cast<__uint64 const *>(it);
+    it += header.numChunks * 16u;
+    __uint64 const * linear = reinterpret_cast<__uint64 const *>(it);
+    it += header.numLinear * 8u;
+
+    _getIndexCacheParams(index, header, it);
+    _loadLinearIndices(index, cacheRefs, linear, header.numRefs);
+    index._unalignedCount = header.unalignedCount;
+
+    clear(index._binIndices);
+    resize(index._binIndices, header.numRefs);
+    for (unsigned r = 0; r < header.numRefs; ++r)
+    {
+        if (!empty(refs) && (r >= length(refs) || !refs[r]))
+            continue;
+
+        // The bins are sorted, insert each behind the previous one.
+        TBinIndex & binIndex = index._binIndices[r];
+        IndexCacheBin_ const * bin = cacheBins + cacheRefs[r].firstBin;
+        for (__uint64 b = 0; b < cacheRefs[r].numBins; ++b, ++bin)
+        {
+            typename TBinIndex::iterator itBin = binIndex.insert(binIndex.end(), std::make_pair(bin->bin, TBinData()));
+            _setBinOffset(itBin->second, bin->loffset);
+
+            String<Pair<__uint64, __uint64> > & chunkBegEnds = itBin->second.chunkBegEnds;
+            resize(chunkBegEnds, bin->numChunks);
+            __uint64 const * chunk = chunks + 2 * bin->firstChunk;
+            for (unsigned c = 0; c < bin->numChunks; ++c, chunk += 2)
+                chunkBegEnds[c] = Pair<__uint64, __uint64>(chunk[0], chunk[1]);
+        }
+    }
+}
+
+template <typename TTag>
+inline void
+loadIndex(BamIndex<TTag> & index, IndexCache const & cache, String<bool> const & refs)
+{
+    loadIndex(index, begin(cache.file, Standard()), refs);
+}
+
+// ----------------------------------------------------------------------------
+// Function saveIndexCache()
+// ----------------------------------------------------------------------------
+
+// Writes the cache of an index that was loaded from a bam index with the size and
+// modification time in source.
+
+template <typename TTag, typename TStream>
+inline bool
+saveIndexCache(TStream & out, BamIndex<TTag> const & index, struct stat const & source)
+{
+    typedef typename BamIndex<TTag>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator  TBinIter;
+
+    IndexCacheHeader_ header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_CACHE_MAGIC, 8);
+    header.version = INDEX_CACHE_VERSION;
+    header.indexType = _indexCacheType(TTag());
+    header.sourceSize = source.st_size;
+    header.sourceMtimeSec = source.st_mtim.tv_sec;
+    header.sourceMtimeNsec = source.st_mtim.tv_nsec;
+    header.unalignedCount = index._unalignedCount;
+    header.numRefs = length(index._binIndices);
+    _setIndexCacheParams(header, index);
+
+    // Count the records and write the reference table.
+    String<IndexCacheRef_> refs;
+    resize(refs, header.numRefs);
+    for (unsigned r = 0; r < header.numRefs; ++r)
+    {
+        refs[r].firstBin = header.numBins;
+        refs[r].numBins = index._binIndices[r].size();
+        refs[r].firstLinear = header.numLinear;
+        refs[r].numLinear = _linearIndexLength(index, r);
+        header.numBins += refs[r].numBins;
+        header.numLinear += refs[r].numLinear;
+        for (TBinIter it = index._binIndices[r].begin(); it != index._binIndices[r].end(); ++it)
+            header.numChunks += length(it->second.chunkBegEnds);
+    }
+
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    if (header.numRefs > 0u)
+        out.write(reinterpret_cast<char const *>(&refs[0]), header.numRefs * sizeof(IndexCacheRef_));
+
+    // Write the bins and the chunks.
+    IndexCacheBin_ bin;
+    memset(&bin, 0, sizeof(bin));
+    for (unsigned r = 0; r < header.numRefs; ++r)
+    {
+        for (TBinIter it = index._binIndices[r].begin(); it != index._binIndices[r].end(); ++it)
+        {
+            bin.bin = it->first;
+            bin.numChunks = length(it->second.chunkBegEnds);
+            bin.loffset = _getBinOffset(it->second);
+            out.write(reinterpret_cast<char const *>(&bin), sizeof(bin));
+            bin.firstChunk += bin.numChunks;
+        }
+    }
+    for (unsigned r = 0; r < header.numRefs; ++r)
+        for (TBinIter it = index._binIndices[r].begin(); it != index._binIndices[r].end(); ++it)
+            for (unsigned c = 0; c < length(it->second.chunkBegEnds); ++c)
+            {
+                out.write(reinterpret_cast<char const *>(&it->second.chunkBegEnds[c].i1), 8);
+                out.write(reinterpret_cast<char const *>(&it->second.chunkBegEnds[c].i2), 8);
+            }
+
+    // Write the linear indices and the auxiliary data.
+    for (unsigned r = 0; r < header.numRefs; ++r)
+        _writeLinearIndex(out, index, r);
+    char const padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    _writeIndexCacheAux(out, index);
+    out.write(padding, _indexCachePad(header.auxLength) - header.auxLength);
+
+    return out.good();
+}
+
+// Writes the cache of an index read from a bam index with the size and
+// modification time in source, as taken by fileStat() before reading it. The
+// cache is written to a temporary file first and renamed, so concurrent runs never
+// map a partial cache. The temporary name holds the process id and a counter of
+// the process, so that threads saving the same cache at the same time write
+// separate files.
+
+template <typename TTag>
+inline bool
+saveIndexCache(BamIndex<TTag> const & index, char const * fileName, struct stat const & source)
+{
+    static std::atomic<unsigned> numSaved(0);
+    std::ostringstream tmpName;
+    tmpName << fileName << ".tmp." << getpid() << '.' << numSaved++;
+
+    std::ofstream out(tmpName.str().c_str(), std::ios::binary | std::ios::out);
+    bool ok = out.is_open() && saveIndexCache(out, index, source);
+    out.close();
+    ok = ok && out.good() && ::rename(tmpName.str().c_str(), fileName) == 0;
+    if (!ok)
+        ::unlink(tmpName.str().c_str());
+    return ok;
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_INDEX_CACHE_H_
@@ -0,0 +1,252 @@
+#ifndef CHOPBAI_INDEX_LOADER_H_
+#define CHOPBAI_INDEX_LOADER_H_
+
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Class IndexProgress
+// ----------------------------------------------------------------------------
+
+// Tracks how many references of a bam index that is loaded in another thread are
+// complete. The references are loaded in order; the size of the index and the
+// parameters of the binning index are set before the first reference is complete.
+// A default constructed progress stands for an index that is loaded completely.
+
+struct IndexProgress
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t numRefs;            // Number of complete references.
+    bool done;                 // Loading has finished or failed.
+    bool ok;                   // Loading has not failed.
+
+    IndexProgress() : numRefs(MaxValue<size_t>::VALUE), done(true), ok(true)
+    {}
+};
+
+// ----------------------------------------------------------------------------
+// Helper Class IndexProgressHook_
+// ----------------------------------------------------------------------------
+
+// Publishes the number of complete references while the index is read.
+
+struct IndexProgressHook_
+{
+    IndexProgress & progress;
+
+    explicit IndexProgressHook_(IndexProgress & progress_) : progress(progress_)
+    {}
+
+    void operator()(size_t numRefs)
+    {
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            progress.numRefs = numRefs;
+        }
+        progress.changed.notify_all();
+    }
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _readBai()
+// ----------------------------------------------------------------------------
+
+// Reads a BAI from fin and calls onReference(i + 1) once reference i is complete.
+
+template <typename TStream, typename TProgress>
+inline bool
+_readBai(BamIndex<Bai> & index, TStream & fin, TProgress & onReference)
+{
+    char magic[4];
+    fin.read(magic, 4);
+    if (!fin.good() || strncmp(magic, "BAI\1", 4) != 0)
+        return false;
+
+    __int32 nRef = 0;
+    fin.read(reinterpret_cast<char *>(&nRef), 4);
+    if (!fin.good() || nRef < 0)
+        return false;
+
+    clear(index._binIndices);
+    clear(index._linearIndices);
+    resize(index._binIndices, nRef);
+    resize(index._linearIndices, nRef);
+
+    BaiBamIndexBinData_ data;
+    for (__int32 i = 0; i < nRef; ++i)
+    {
+        // Read the bins and their chunks.
+        __int32 nBin = 0;
+        fin.read(reinterpret_cast<char *>(&nBin), 4);
+        if (!fin.good())
+            return false;
+
+        for (__int32 j = 0; j < nBin; ++j)
+        {
+            __uint32 bin = 0;
+            __int32 nChunk = 0;
+            fin.read(reinterpret_cast<char *>(&bin), 4);
+            fin.read(reinterpret_cast<char *>(&nChunk), 4);
+            if (!fin.good() || nChunk < 0)
+                return false;
+
+            resize(data.chunkBegEnds, nChunk);
+            for (__int32 k = 0; k < nChunk; ++k)
+            {
+                fin.read(reinterpret_cast<char *>(&data.chunkBegEnds[k].i1), 8);
+                fin.read(reinterpret_cast<char *>(&data.chunkBegEnds[k].i2), 8);
+            }
+            if (!fin.good())
+                return false;
+            index._binIndices[i][bin] = data;
+        }
+
+        // Read the linear index.
+        __int32 nIntv = 0;
+        fin.read(reinterpret_cast<char *>(&nIntv), 4);
+        if (!fin.good() || nIntv < 0)
+            return false;
+        resize(index._linearIndices[i], nIntv);
+        if (nIntv > 0)
+            fin.read(reinterpret_cast<char *>(&index._linearIndices[i][0]), 8 * nIntv);
+        if (!fin.good())
+            return false;
+
+        onReference(i + 1);
+    }
+
+    // Read (optional) number of alignments without coordinate.
+    __uint64 nNoCoord = 0;
+    fin.read(reinterpret_cast<char *>(&nNoCoord), 8);
+    index._unalignedCount = fin.good() ? nNoCoord : maxValue<__uint64>();
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+template <typename TProgress>
+inline bool
+open(BamIndex<Bai> & index, char const * filename, TProgress & onReference)
+{
+    std::ifstream fin(filename, std::ios::binary | std::ios::in);
+    if (!fin.good())
+        return false;
+    return _readBai(index, fin, onReference);
+}
+
+// ----------------------------------------------------------------------------
+// Function readIndex()
+// ----------------------------------------------------------------------------
+
+// Reads the bam index and publishes each complete reference in progress. Runs in
+// the thread started by startReadIndex().
+
+template <typename TTag>
+inline void
+readIndex(BamIndex<TTag> & index, CharString const & indexfile, IndexProgress & progress)
+{
+    IndexProgressHook_ hook(progress);
+    bool ok = open(index, toCString(indexfile), hook);
+
+    {
+        std::lock_guard<std::mutex> lock(progress.mutex);
+        if (ok)
+            progress.numRefs = length(index._binIndices);
+        progress.ok = ok;
+        progress.done = true;
+    }
+    progress.changed.notify_all();
+}
+
+// ----------------------------------------------------------------------------
+// Function startReadIndex()
+// ----------------------------------------------------------------------------
+
+// Resets progress and starts reading the bam index in a new thread.
+
+template <typename TTag>
+inline std::thread
+startReadIndex(BamIndex<TTag> & index, CharString const & indexfile, IndexProgress & progress)
+{
+    progress.numRefs = 0;
+    progress.done = false;
+    progress.ok = true;
+    return std::thread(readIndex<TTag>, std::ref(index), std::cref(indexfile), std::ref(progress));
+}
+
+// ----------------------------------------------------------------------------
+// Function waitForReferences()
+// ----------------------------------------------------------------------------
+
+// Waits until the first numRefs references are loaded. Returns false if loading
+// failed before or the index has fewer references.
+
+inline bool
+waitForReferences(IndexProgress & progress, size_t numRefs)
+{
+    std::unique_lock<std::mutex> lock(progress.mutex);
+    while (!progress.done && progress.numRefs < numRefs)
+        progress.changed.wait(lock);
+    return progress.numRefs >= numRefs;
+}
+
+// ----------------------------------------------------------------------------
+// Function waitForIndex()
+// ----------------------------------------------------------------------------
+
+// Waits until the whole index including the trailing number of unaligned reads
+// is loaded. Returns false if loading failed.
+
+inline bool
+waitForIndex(IndexProgress & progress)
+{
+    std::unique_lock<std::mutex> lock(progress.mutex);
+    while (!progress.done)
+        progress.changed.wait(lock);
+    return progress.ok;
+}
+
+// ----------------------------------------------------------------------------
+// Function waitForReference()
+// ----------------------------------------------------------------------------
+
+// Waits until the index holds everything needed to crop an interval on refId.
+// Cropping a BAI on a reference without linear index looks at the linear indices
+// of the following references.
+
+inline bool
+waitForReference(IndexProgress & progress, BamIndex<Bai> const & index, size_t refId)
+{
+    if (!waitForReferences(progress, refId + 1))
+        return false;
+    if (refId < length(index._linearIndices) && empty(index._linearIndices[refId]))
+        return waitForReferences(progress, length(index._linearIndices));
+    return true;
+}
+
+inline bool
+waitForReference(IndexProgress & progress, BamIndex<Csi> const & /*index*/, size_t refId)
+{
+    return waitForReferences(progress, refId + 1);
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_INDEX_LOADER_H_
@@ -0,0 +1,468 @@
+#ifndef CHOPBAI_INDEX_QUERY_H_
+#define CHOPBAI_INDEX_QUERY_H_
+
+#include <algorithm>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Class GenomicInterval
+// ----------------------------------------------------------------------------
+
+// A region [begin, end) on reference chrId; end is MaxValue for the whole reference.
+
+struct GenomicInterval {
+    size_t chrId;
+    __uint32 begin;
+    __uint32 end;
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function levelFirstBin()
+// ----------------------------------------------------------------------------
+
+// The number of the first bin on a level of a binning index; level 0 is the root.
+
+inline __uint32
+levelFirstBin(__int32 level)
+{
+    return ((1u << (3 * level)) - 1) / 7;
+}
+
+// ----------------------------------------------------------------------------
+// Function binLevel()
+// ----------------------------------------------------------------------------
+
+// The level of a bin of a binning index with the given depth.
+
+inline __int32
+binLevel(__uint32 bin, __int32 depth)
+{
+    __int32 level = 0;
+    while (level < depth && bin >= levelFirstBin(level + 1))
+        ++level;
+    return level;
+}
+
+// ----------------------------------------------------------------------------
+// Function binFirstWindow()
+// ----------------------------------------------------------------------------
+
+// The first window of minimal size covered by a bin of a binning index with the
+// given depth.
+
+inline __uint64
+binFirstWindow(__uint32 bin, __int32 depth)
+{
+    __int32 level = binLevel(bin, depth);
+    return (__uint64)(bin - levelFirstBin(level)) << (3 * (depth - level));
+}
+
+// ----------------------------------------------------------------------------
+// Function getCandidateBinRanges()
+// ----------------------------------------------------------------------------
+
+// Lists the bins that may hold alignments overlapping [beg, end) as one range
+// [first, last] of bin numbers per level, from the root to the smallest bins.
+// The ranges are sorted, so the bins of an index within them are found in one
+// ordered pass over the bin map, however large the region is.
+
+inline void
+_getCandidateBinRanges(String<Pair<__uint32, __uint32> > & binRanges, __uint64 beg, __uint64 end,
+                       __int32 minShift, __int32 depth)
+{
+    clear(binRanges);
+    end = _min(end, (__uint64)1 << (minShift + 3 * depth));
+    if (beg >= end)
+        return;
+
+    --end;
+    unsigned shift = minShift + 3 * depth;
+    for (__int32 level = 0; level <= depth; ++level, shift -= 3)
+    {
+        __uint32 firstBin = levelFirstBin(level);
+        appendValue(binRanges, Pair<__uint32, __uint32>(firstBin + (beg >> shift), firstBin + (end >> shift)));
+    }
+}
+
+inline void
+getCandidateBinRanges(String<Pair<__uint32, __uint32> > & binRanges, __uint32 beg, __uint32 end,
+                      BamIndex<Bai> const & /*index*/)
+{
+    _getCandidateBinRanges(binRanges, beg, end, 14, 5);
+}
+
+inline void
+getCandidateBinRanges(String<Pair<__uint32, __uint32> > & binRanges, __uint32 beg, __uint32 end,
+                      BamIndex<Csi> const & index)
+{
+    _getCandidateBinRanges(binRanges, beg, end, index._minShift, index._depth);
+}
+
+// ----------------------------------------------------------------------------
+// Function metaBin()
+// ----------------------------------------------------------------------------
+
+// The pseudo-bin holding the file range and read counts of a reference.
+
+inline __uint32
+metaBin(BamIndex<Bai> const & /*index*/)
+{
+    return 37450u;
+}
+
+inline __uint32
+metaBin(BamIndex<Csi> const & index)
+{
+    return levelFirstBin(index._depth + 1) + 1;
+}
+
+// ----------------------------------------------------------------------------
+// Function binningMinShift()
+// ----------------------------------------------------------------------------
+
+// The number of bits of the windows covered by the bins on the deepest level.
+
+inline int
+binningMinShift(BamIndex<Bai> const & /*index*/)
+{
+    return 14;
+}
+
+inline int
+binningMinShift(BamIndex<Csi> const & index)
+{
+    return index._minShift;
+}
+
+// ----------------------------------------------------------------------------
+// Function binningDepth()
+// ----------------------------------------------------------------------------
+
+inline int
+binningDepth(BamIndex<Bai> const & /*index*/)
+{
+    return 5;
+}
+
+inline int
+binningDepth(BamIndex<Csi> const & index)
+{
+    return index._depth;
+}
+
+// ----------------------------------------------------------------------------
+// Function queryMinOffset()
+// ----------------------------------------------------------------------------
+
+// Returns the smallest file offset that may hold an alignment overlapping a query
+// starting at position beg, i.e. the offset below which a reader skips chunks.
+
+inline __uint64
+queryMinOffset(BamIndex<Bai> const & index, __int32 refId, __uint32 beg)
+{
+    if (refId < 0 || static_cast<unsigned>(refId) >= length(index._linearIndices))
+        return 0u;
+
+    String<__uint64> const & linearIndex = index._linearIndices[refId];
+    if (empty(linearIndex))
+        return 0u;
+
+    // Use the last window for positions behind the linear index and fall back
+    // to the previous non-zero entry for empty windows.
+    size_t windowIdx = _min((size_t)(beg >> 14), length(linearIndex) - 1);
+    __uint64 offset = linearIndex[windowIdx];
+    while (offset == 0u && windowIdx > 0u)
+        offset = linearIndex[--windowIdx];
+    return offset;
+}
+
+// The loffset of the closest existing bin at or left of beg on the deepest level,
+// moving up one level whenever the first bin of a sibling group is passed.
+
+inline __uint64
+queryMinOffset(BamIndex<Csi> const & index, __int32 refId, __uint32 beg)
+{
+    typedef BamIndex<Csi>::TBinIndex_ TBinIndex;
+    if (refId < 0 || static_cast<unsigned>(refId) >= length(index._binIndices))
+        return 0u;
+
+    TBinIndex const & binIndex = index._binIndices[refId];
+
+    __uint32 bin = levelFirstBin(index._depth) + ((__uint64)beg >> index._minShift);
+    TBinIndex::const_iterator it = binIndex.end();
+    while (bin > 0u)
+    {
+        it = binIndex.find(bin);
+        if (it != binIndex.end())
+            break;
+        __uint32 first = (((bin - 1) >> 3) << 3) + 1;
+        bin = (bin > first) ? bin - 1 : (bin - 1) >> 3;
+    }
+    if (bin == 0u)
+        it = binIndex.find(0u);
+
+    return (it != binIndex.end()) ? it->second.loffset : 0u;
+}
+
+// ----------------------------------------------------------------------------
+// Function mergeChunks()
+// ----------------------------------------------------------------------------
+
+// Sorts the chunks and merges overlapping and adjacent chunks.
+
+inline void
+mergeChunks(String<Pair<__uint64, __uint64> > & chunks)
+{
+    if (empty(chunks))
+        return;
+
+    std::sort(begin(chunks, Standard()), end(chunks, Standard()));
+
+    size_t last = 0;
+    for (size_t i = 1; i < length(chunks); ++i)
+    {
+        if (chunks[i].i1 <= chunks[last].i2)
+            chunks[last].i2 = _max(chunks[last].i2, chunks[i].i2);
+        else
+            chunks[++last] = chunks[i];
+    }
+    resize(chunks, last + 1);
+}
+
+// ----------------------------------------------------------------------------
+// Function queryChunks()
+// ----------------------------------------------------------------------------
+
+// Resolves a query [beg, end) on reference refId to the sorted, merged list of
+// file ranges a reader visits. Chunks ending at or before minOffset are skipped
+// and the remaining ones are clipped to start at minOffset or later.
+
+template <typename TSpec>
+inline void
+queryChunks(String<Pair<__uint64, __uint64> > & ranges,
+            String<Pair<__uint32, __uint32> > & binRanges,
+            BamIndex<TSpec> const & index,
+            __int32 refId,
+            __uint32 beg,
+            __uint32 end,
+            __uint64 minOffset)
+{
+    typedef typename BamIndex<TSpec>::TBinIndex_ TBinIndex;
+    typedef typename TBinIndex::const_iterator   TBinIter;
+
+    clear(ranges);
+    if (refId < 0 || static_cast<unsigned>(refId) >= length(index._binIndices))
+        return;
+
+    TBinIndex const & binIndex = index._binIndices[refId];
+    getCandidateBinRanges(binRanges, beg, end, index);
+    for (unsigned i = 0; i < length(binRanges); ++i)
+    {
+        TBinIter it = binIndex.lower_bound(binRanges[i].i1);
+        for (; it != binIndex.end() && it->first <= binRanges[i].i2; ++it)
+        {
+            for (unsigned j = 0; j < length(it->second.chunkBegEnds); ++j)
+            {
+                Pair<__uint64, __uint64> chunk = it->second.chunkBegEnds[j];
+                if (chunk.i2 <= minOffset)
+                    continue;
+                chunk.i1 = _max(chunk.i1, minOffset);
+                appendValue(ranges, chunk);
+            }
+        }
+    }
+
+    mergeChunks(ranges);
+}
+
+template <typename TSpec>
+inline void
+queryChunks(String<Pair<__uint64, __uint64> > & ranges,
+            String<Pair<__uint32, __uint32> > & binRanges,
+            BamIndex<TSpec> const & index,
+            __int32 refId,
+            __uint32 beg,
+            __uint32 end)
+{
+    queryChunks(ranges, binRanges, index, refId, beg, end, queryMinOffset(index, refId, beg));
+}
+
+// ----------------------------------------------------------------------------
+// Function cropInterval()
+// ----------------------------------------------------------------------------
+
+// Copies the bins and chunks of the input index that queries within the interval
+// use, given the candidate bin ranges of the interval. Only reads the input index.
+
+inline void
+cropInterval(BamIndex<Csi> & outcsi, BamIndex<Csi> const & incsi, GenomicInterval const & interval,
+             String<Pair<__uint32, __uint32> > const & binRanges, bool )
+{
+    // Initialize the output bam index
+    outcsi._minShift = incsi._minShift;
+    outcsi._depth = incsi._depth;
+    __int32 nRef = length(incsi._binIndices);
+    resize(outcsi._binIndices, nRef);
+
+    // --- Crop the region from the bin index ---
+
+    // Walk the existing bins within the candidate range of each level.
+    typedef std::map<__uint32, CsiBamIndexBinData_>::const_iterator TMapIter;
+    std::map<__uint32, CsiBamIndexBinData_> const & inBins = incsi._binIndices[interval.chrId];
+    std::map<__uint32, CsiBamIndexBinData_> & outBins = outcsi._binIndices[interval.chrId];
+    for (unsigned i = 0; i < length(binRanges); ++i)
+    {
+        for (TMapIter mIt = inBins.lower_bound(binRanges[i].i1); mIt != inBins.end() && mIt->first <= binRanges[i].i2;
+             ++mIt)
+        {
+            if (length(mIt->second.chunkBegEnds) > 0)
+                outBins.insert(outBins.end(), *mIt);
+        }
+    }
+
+    // Copy the metabin if whole chromosome is cropped.
+    if (interval.begin == 0 && interval.end == MaxValue<__uint32>::VALUE)
+    {
+        typedef std::map<__uint32, CsiBamIndexBinData_>::const_iterator TMapIter;
+        TMapIter mIt = incsi._binIndices[interval.chrId].find(metaBin(incsi));
+        if (mIt != incsi._binIndices[interval.chrId].end())
+            outcsi._binIndices[interval.chrId][mIt->first] = mIt->second;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+inline void
+cropInterval(BamIndex<Bai> & outbai, BamIndex<Bai> const & inbai, GenomicInterval const & interval,
+             String<Pair<__uint32, __uint32> > const & binRanges, bool writeLinear)
+{
+    // Initialize the output bam index
+    __int32 nRef = length(inbai._linearIndices);
+    resize(outbai._linearIndices, nRef);
+    resize(outbai._binIndices, nRef);
+
+    // --- Crop the region from the linear index ---
+
+    unsigned windowIdx = interval.begin >> 14;  // Linear index consists of 16kb windows.
+    unsigned windowEndIdx = (interval.end >> 14) + 1;
+
+    __uint64 linearMinOffset = 0;
+
+    if (windowIdx < length(inbai._linearIndices[interval.chrId]))
+    {
+        linearMinOffset = inbai._linearIndices[interval.chrId][windowIdx];
+
+        __uint64 minOffset = 0u;
+        for (unsigned i = interval.chrId; i < length(inbai._linearIndices); ++i)
+        {
+            if (!empty(inbai._linearIndices[i]))
+            {
+                minOffset = front(inbai._linearIndices[i]);
+                break;
+            }
+        }
+
+        // Crop the linear index if user asked for it.
+        if (writeLinear)
+        {
+            for (unsigned i = 0; i < windowIdx; ++i)
+                appendValue(outbai._linearIndices[interval.chrId], minOffset);
+            for (unsigned i = windowIdx; i < _min(windowEndIdx, length(inbai._linearIndices[interval.chrId])); ++i)
+                appendValue(outbai._linearIndices[interval.chrId], inbai._linearIndices[interval.chrId][i]);
+        }
+    }
+    else  // set linearMinOffset to next non-zero entry in linear indices
+    {
+        if (empty(inbai._linearIndices[interval.chrId]))
+        {
+            for (unsigned i = interval.chrId; i < length(inbai._linearIndices); ++i)
+            {
+                if (!empty(inbai._linearIndices[i]))
+                {
+                    linearMinOffset = front(inbai._linearIndices[i]);
+                    if (linearMinOffset != 0u)
+                        break;
+                    for (unsigned j = 1; j < length(inbai._linearIndices[i]); ++j)
+                    {
+                        if (inbai._linearIndices[i][j] != 0u)
+                        {
+                            linearMinOffset = inbai._linearIndices[i][j];
+                            break;
+                        }
+                    }
+                    if (linearMinOffset != 0u)
+                        break;
+                }
+            }
+        }
+        else
+        {
+            linearMinOffset = back(inbai._linearIndices[interval.chrId]);
+        }
+    }
+
+    // --- Crop the region from the bin index ---
+
+    // Walk the existing bins within the candidate range of each level.
+    typedef std::map<__uint32, BaiBamIndexBinData_>::const_iterator TMapIter;
+    std::map<__uint32, BaiBamIndexBinData_> const & inBins = inbai._binIndices[interval.chrId];
+    std::map<__uint32, BaiBamIndexBinData_> & outBins = outbai._binIndices[interval.chrId];
+    for (unsigned i = 0; i < length(binRanges); ++i)
+    {
+        for (TMapIter mIt = inBins.lower_bound(binRanges[i].i1); mIt != inBins.end() && mIt->first <= binRanges[i].i2;
+             ++mIt)
+        {
+            BaiBamIndexBinData_ chunks;
+            typedef Iterator<String<Pair<__uint64, __uint64> > const, Rooted>::Type TBegEndIter;
+            for (TBegEndIter it2 = begin(mIt->second.chunkBegEnds, Rooted()); !atEnd(it2); goNext(it2))
+                if (it2->i2 >= linearMinOffset)
+                    appendValue(chunks.chunkBegEnds, *it2);
+
+            if (length(chunks.chunkBegEnds) > 0)
+                outBins.insert(outBins.end(), std::make_pair(mIt->first, chunks));
+        }
+    }
+
+    // Copy the metabin (magic bin number 37450) if whole chromosome is cropped.
+    if (interval.begin == 0 && interval.end == MaxValue<__uint32>::VALUE)
+    {
+        TMapIter mIt = inBins.find(37450);
+        if (mIt != inBins.end())  // References without alignments have no metabin.
+            outBins[37450] = mIt->second;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Function rangesContained()
+// ----------------------------------------------------------------------------
+
+// Returns true if each range of the sorted, merged list inner lies within a
+// range of the sorted, merged list outer.
+
+inline bool
+rangesContained(String<Pair<__uint64, __uint64> > const & inner,
+                String<Pair<__uint64, __uint64> > const & outer)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < length(inner); ++i)
+    {
+        while (j < length(outer) && outer[j].i2 < inner[i].i2)
+            ++j;
+        if (j == length(outer) || outer[j].i1 > inner[i].i1)
+            return false;
+    }
+    return true;
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_INDEX_QUERY_H_
@@ -0,0 +1,248 @@
+#ifndef CHOPBAI_OUTPUT_URING_H_
+#define CHOPBAI_OUTPUT_URING_H_
+
+// Minimal io_uring submission and completion ring on top of the raw system calls.
+// Compiled only if the kernel headers provide direct descriptors (Linux 5.19);
+// define CHOPBAI_HAS_IO_URING=0 to disable it.
+
+#ifndef CHOPBAI_HAS_IO_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RSRC_REGISTER_SPARSE
+#define CHOPBAI_HAS_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#ifndef CHOPBAI_HAS_IO_URING
+#define CHOPBAI_HAS_IO_URING 0
+#endif
+
+#if CHOPBAI_HAS_IO_URING
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Helper Class UringRing_
+// ----------------------------------------------------------------------------
+
+// The mapped rings of an io_uring instance with a table of registered files.
+
+struct UringRing_
+{
+    int fd;
+    unsigned sqEntries;
+
+    unsigned * sqHead;
+    unsigned * sqTail;
+    unsigned * sqMask;
+    unsigned * sqArray;
+    struct io_uring_sqe * sqes;
+    unsigned sqLocalTail;      // Tail including prepared, not yet submitted entries.
+
+    unsigned * cqHead;
+    unsigned * cqTail;
+    unsigned * cqMask;
+    struct io_uring_cqe * cqes;
+
+    void * sqRing;
+    size_t sqRingSize;
+    void * cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    UringRing_() :
+        fd(-1), sqEntries(0), sqHead(0), sqTail(0), sqMask(0), sqArray(0), sqes(0), sqLocalTail(0),
+        cqHead(0), cqTail(0), cqMask(0), cqes(0),
+        sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0), sqesSize(0)
+    {}
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _uringExit()
+// ----------------------------------------------------------------------------
+
+inline void
+_uringExit(UringRing_ & ring)
+{
+    if (ring.sqes != 0)
+        ::munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing)
+        ::munmap(ring.cqRing, ring.cqRingSize);
+    if (ring.sqRing != MAP_FAILED)
+        ::munmap(ring.sqRing, ring.sqRingSize);
+    if (ring.fd != -1)
+        ::close(ring.fd);
+    ring = UringRing_();
+}
+
+// ----------------------------------------------------------------------------
+// Function _uringSupports()
+// ----------------------------------------------------------------------------
+
+// Returns true if the kernel supports all operations in ops.
+
+inline bool
+_uringSupports(UringRing_ const & ring, unsigned char const * ops, unsigned numOps)
+{
+    std::vector<char> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe * probe = reinterpret_cast<struct io_uring_probe *>(&buffer[0]);
+    if (::syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+
+    for (unsigned i = 0; i < numOps; ++i)
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _uringInit()
+// ----------------------------------------------------------------------------
+
+// Sets up a ring with at least entries submission entries and a table of numFiles
+// empty registered file slots. Returns false if the kernel does not support
+// io_uring or one of the operations in ops.
+
+inline bool
+_uringInit(UringRing_ & ring, unsigned entries, unsigned numFiles, unsigned char const * ops, unsigned numOps)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0)
+    {
+        ring.fd = -1;
+        return false;
+    }
+
+    // Map the submission and completion rings and the submission entries.
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+
+    ring.sqRing = ::mmap(0, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                         IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED)
+    {
+        _uringExit(ring);
+        return false;
+    }
+    ring.cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring.sqRing :
+                  ::mmap(0, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                         IORING_OFF_CQ_RING);
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void * sqes = ::mmap(0, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        _uringExit(ring);
+        return false;
+    }
+
+    char * sq = static_cast<char *>(ring.sqRing);
+    char * cq = static_cast<char *>(ring.cqRing);
+    ring.sqEntries = params.sq_entries;
+    ring.sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring.sqes = static_cast<struct io_uring_sqe *>(sqes);
+    ring.sqLocalTail = *ring.sqTail;
+    ring.cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Check the operations and register the empty file slots.
+    std::vector<int> files(numFiles, -1);
+    if (!_uringSupports(ring, ops, numOps) ||
+        ::syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, &files[0], numFiles) < 0)
+    {
+        _uringExit(ring);
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _uringGetSqe()
+// ----------------------------------------------------------------------------
+
+// Returns a cleared submission entry, or 0 if the submission ring is full.
+
+inline struct io_uring_sqe *
+_uringGetSqe(UringRing_ & ring)
+{
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    if (ring.sqLocalTail - head >= ring.sqEntries)
+        return 0;
+
+    unsigned idx = ring.sqLocalTail++ & *ring.sqMask;
+    ring.sqArray[idx] = idx;
+    struct io_uring_sqe * sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// ----------------------------------------------------------------------------
+// Function _uringSubmitAndWait()
+// ----------------------------------------------------------------------------
+
+// Submits the prepared entries and waits until numExpected completions are reaped.
+// Calls handler(userData, res) for each completion. Returns false on an error of
+// io_uring_enter().
+
+template <typename THandler>
+inline bool
+_uringSubmitAndWait(UringRing_ & ring, unsigned numExpected, THandler & handler)
+{
+    __atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring.sqLocalTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+
+    unsigned numReaped = 0;
+    while (numReaped < numExpected)
+    {
+        int res = ::syscall(__NR_io_uring_enter, ring.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+        if (res > 0)
+            toSubmit -= _min((unsigned)res, toSubmit);
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++numReaped)
+        {
+            struct io_uring_cqe const & cqe = ring.cqes[head & *ring.cqMask];
+            handler(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+}  // namespace seqan
+
+#endif  // #if CHOPBAI_HAS_IO_URING
+
+#endif  // #ifndef CHOPBAI_OUTPUT_URING_H_
@@ -0,0 +1,499 @@
+#ifndef CHOPBAI_OUTPUT_WRITER_H_
+#define CHOPBAI_OUTPUT_WRITER_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "output_uring.h"
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+#if CHOPBAI_HAS_IO_URING
+
+// Number of regions written per io_uring batch.
+static const unsigned URING_BATCH_SIZE = 256;
+
+// ----------------------------------------------------------------------------
+// Helper Class PendingRegion_
+// ----------------------------------------------------------------------------
+
+// A region queued for writing with io_uring.
+
+struct PendingRegion_
+{
+    int dirFd;                 // Parent directory of the region directory.
+    std::string dirPath;       // '<region>'
+    std::string filePath;      // '<region>/<index>'
+    std::string linkPath;      // '<region>/<link>', empty if none.
+    std::string data;
+    int results[5];            // Results of mkdir, open, write, close and symlink.
+};
+
+#endif  // #if CHOPBAI_HAS_IO_URING
+
+// ----------------------------------------------------------------------------
+// Class OutputWriter
+// ----------------------------------------------------------------------------
+
+// Writes the index file of each region to '<prefix>/<region>/<indexFileName>'.
+// The prefix directory is opened once and all files are created relative to its
+// file descriptor. With fanOut, the region directories are distributed over a
+// hashed two-level layout '<prefix>/<xx>/<yy>/<region>' to keep directories small.
+// Regions may be written from several threads at a time. With useUring, regions
+// are queued and written in batches of linked io_uring operations.
+
+struct OutputWriter
+{
+    int prefixFd;
+    bool fanOut;
+
+    CharString indexFileName;  // Name of the index file in each region directory.
+    CharString linkName;       // Name of the symbolic link to the bam file, empty if none.
+    CharString linkTarget;     // Absolute path of the bam file.
+
+    String<int> fanOutFds;     // First level fan-out directories, -1 if not opened yet.
+
+    bool useUring;
+    unsigned numFailed;        // Queued regions that could not be written.
+#if CHOPBAI_HAS_IO_URING
+    UringRing_ ring;
+    std::vector<PendingRegion_> batch;
+    std::mutex batchMutex;
+#endif
+
+    OutputWriter() : prefixFd(-1), fanOut(false), useUring(false), numFailed(0)
+    {}
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _fanOutHash()
+// ----------------------------------------------------------------------------
+
+// 16 bit FNV-1a hash of the region name.
+
+template <typename TName>
+inline unsigned
+_fanOutHash(TName const & name)
+{
+    __uint32 h = 2166136261u;
+    for (unsigned i = 0; i < length(name); ++i)
+    {
+        h ^= static_cast<unsigned char>(name[i]);
+        h *= 16777619u;
+    }
+    return (h >> 16) ^ (h & 0xffff);
+}
+
+// ----------------------------------------------------------------------------
+// Function _mkdirAt()
+// ----------------------------------------------------------------------------
+
+// Creates a directory relative to dirFd. An existing directory is not an error.
+
+inline bool
+_mkdirAt(int dirFd, char const * name)
+{
+    return ::mkdirat(dirFd, name, 0755) == 0 || errno == EEXIST;
+}
+
+// ----------------------------------------------------------------------------
+// Function _parentDirectory()
+// ----------------------------------------------------------------------------
+
+// Returns a file descriptor of the directory that contains the region directory.
+// The descriptor of a second level fan-out directory has to be closed by the caller.
+
+template <typename TName>
+inline int
+_parentDirectory(OutputWriter & writer, TName const & regionName)
+{
+    if (!writer.fanOut)
+        return writer.prefixFd;
+
+    unsigned h = _fanOutHash(regionName);
+    char level[3];
+
+    int level1Fd;
+    SEQAN_OMP_PRAGMA(critical (fanOut))
+    {
+        int & fd = writer.fanOutFds[h >> 8];
+        if (fd == -1)
+        {
+            snprintf(level, sizeof(level), "%02x", h >> 8);
+            if (_mkdirAt(writer.prefixFd, level))
+                fd = ::openat(writer.prefixFd, level, O_RDONLY | O_DIRECTORY);
+        }
+        level1Fd = fd;
+    }
+    if (level1Fd == -1)
+        return -1;
+
+    snprintf(level, sizeof(level), "%02x", h & 0xff);
+    if (!_mkdirAt(level1Fd, level))
+        return -1;
+    return ::openat(level1Fd, level, O_RDONLY | O_DIRECTORY);
+}
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+// The index file name is the file name of indexfile. If createSymlink is set, a
+// symbolic link named like the index without its extension, ending in '.bam',
+// is created next to each index. If useUring is set but io_uring is not
+// available, the files are written synchronously.
+
+inline bool
+open(OutputWriter & writer,
+     CharString const & outputPrefix,
+     CharString const & indexfile,
+     CharString const & bamfile,
+     bool createSymlink,
+     bool fanOut,
+     bool useUring)
+{
+    writer.prefixFd = ::open(toCString(outputPrefix), O_RDONLY | O_DIRECTORY);
+    if (writer.prefixFd == -1)
+    {
+        std::cerr << "ERROR: Could not open output directory " << outputPrefix << std::endl;
+        return false;
+    }
+
+    // Crop the filename from the path of the index file.
+    size_t i = length(indexfile);
+    while (i > 0u && indexfile[i - 1] != '/')
+        --i;
+    writer.indexFileName = suffix(indexfile, i);
+
+    writer.fanOut = fanOut;
+    if (fanOut)
+        resize(writer.fanOutFds, 256, -1);
+
+    clear(writer.linkName);
+    if (createSymlink)
+    {
+        // The symbolic link points to the absolute path of the bam file.
+        if (empty(bamfile) || bamfile[0] != '/')
+        {
+            char buf[10240];
+            if (getcwd(buf, 10240) == 0) {
+              std::cerr << "ERROR: could not get current directory?!?" << std::endl;
+              return false;
+            }
+            writer.linkTarget = buf;
+            writer.linkTarget += "/";
+        }
+        writer.linkTarget += bamfile;
+
+        writer.linkName = prefix(writer.indexFileName, length(writer.indexFileName) - 4);
+        if (length(writer.linkName) < 4 || suffix(writer.linkName, length(writer.linkName) - 4) != ".bam")
+            writer.linkName += ".bam";
+    }
+
+    writer.useUring = false;
+    writer.numFailed = 0;
+#if CHOPBAI_HAS_IO_URING
+    if (useUring)
+    {
+        static unsigned char const ops[] = {IORING_OP_MKDIRAT, IORING_OP_OPENAT, IORING_OP_WRITE,
+                                            IORING_OP_CLOSE, IORING_OP_SYMLINKAT};
+        writer.useUring = _uringInit(writer.ring, URING_BATCH_SIZE * 5, URING_BATCH_SIZE, ops, 5);
+        writer.batch.reserve(URING_BATCH_SIZE);
+    }
+#endif
+    if (useUring && !writer.useUring)
+    {
+        SEQAN_OMP_PRAGMA(critical (cerr))
+        std::cerr << "WARNING: io_uring is not available, writing the output files synchronously." << std::endl;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _writeRegionFiles()
+// ----------------------------------------------------------------------------
+
+// Synchronously creates the directory path in dirFd and writes data as its index file.
+
+inline bool
+_writeRegionFiles(OutputWriter const & writer, int dirFd, std::string & path, std::string const & data)
+{
+    // Create output directory if not exists.
+    bool ok = _mkdirAt(dirFd, path.c_str());
+
+    // Write the output bam index for the region.
+    size_t dirLength = path.size();
+    path += '/';
+    path.append(begin(writer.indexFileName, Standard()), end(writer.indexFileName, Standard()));
+
+    int fd = ok ? ::openat(dirFd, path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd == -1)
+    {
+        SEQAN_OMP_PRAGMA(critical (cerr))
+        std::cerr << "ERROR: Could not open output file: " << path << std::endl;
+        ok = false;
+    }
+    else
+    {
+        for (size_t written = 0; ok && written < data.size(); )
+        {
+            ssize_t res = ::write(fd, data.data() + written, data.size() - written);
+            if (res < 0 && errno == EINTR)
+                continue;
+            ok = res > 0;
+            written += ok ? res : 0;
+        }
+        ok = (::close(fd) == 0) && ok;
+        if (!ok)
+        {
+            SEQAN_OMP_PRAGMA(critical (cerr))
+            std::cerr << "ERROR: Could not write output file: " << path << std::endl;
+        }
+    }
+
+    // Create a symbolic link to the bam file if wished.
+    if (ok && !empty(writer.linkName))
+    {
+        path.resize(dirLength + 1);
+        path.append(begin(writer.linkName, Standard()), end(writer.linkName, Standard()));
+        ::symlinkat(toCString(writer.linkTarget), dirFd, path.c_str());
+    }
+
+    return ok;
+}
+
+#if CHOPBAI_HAS_IO_URING
+
+// ----------------------------------------------------------------------------
+// Helper Class UringResults_
+// ----------------------------------------------------------------------------
+
+// Stores the result of each completed operation with the region it belongs to.
+
+struct UringResults_
+{
+    std::vector<PendingRegion_> & batch;
+
+    explicit UringResults_(std::vector<PendingRegion_> & batch_) : batch(batch_)
+    {}
+
+    void operator()(__uint64 userData, int res)
+    {
+        batch[userData / 5].results[userData % 5] = res;
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Function _flushBatch()
+// ----------------------------------------------------------------------------
+
+// Writes the queued regions. The operations of a region are linked: the index is
+// opened into the registered file slot of the region, written and closed, then the
+// symbolic link is created. The directory is created first regardless of whether
+// it exists. Regions with a failed operation are written again synchronously.
+// The caller has to hold the batch mutex.
+
+inline void
+_flushBatch(OutputWriter & writer)
+{
+    std::vector<PendingRegion_> & batch = writer.batch;
+    if (batch.empty())
+        return;
+
+    // Without a ring, all regions are written synchronously below.
+    std::string linkTarget(toCString(writer.linkTarget));
+    unsigned numOps = 0;
+    for (unsigned k = 0; k < batch.size(); ++k)
+    {
+        PendingRegion_ & region = batch[k];
+        std::fill(region.results, region.results + 5, -ECANCELED);
+        if (writer.ring.fd == -1)
+            continue;
+
+        struct io_uring_sqe * sqe = _uringGetSqe(writer.ring);
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->fd = region.dirFd;
+        sqe->addr = reinterpret_cast<__uint64>(region.dirPath.c_str());
+        sqe->len = 0755;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = k * 5;
+
+        sqe = _uringGetSqe(writer.ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = region.dirFd;
+        sqe->addr = reinterpret_cast<__uint64>(region.filePath.c_str());
+        sqe->len = 0644;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->file_index = k + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = k * 5 + 1;
+
+        sqe = _uringGetSqe(writer.ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = k;
+        sqe->addr = reinterpret_cast<__uint64>(region.data.data());
+        sqe->len = region.data.size();
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = k * 5 + 2;
+
+        sqe = _uringGetSqe(writer.ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = k + 1;
+        sqe->flags = region.linkPath.empty() ? 0 : IOSQE_IO_HARDLINK;
+        sqe->user_data = k * 5 + 3;
+        numOps += 4;
+
+        if (!region.linkPath.empty())
+        {
+            sqe = _uringGetSqe(writer.ring);
+            sqe->opcode = IORING_OP_SYMLINKAT;
+            sqe->fd = region.dirFd;
+            sqe->addr = reinterpret_cast<__uint64>(linkTarget.c_str());
+            sqe->addr2 = reinterpret_cast<__uint64>(region.linkPath.c_str());
+            sqe->user_data = k * 5 + 4;
+            ++numOps;
+        }
+    }
+
+    // Fall back to synchronous writing for good if the ring fails.
+    UringResults_ results(batch);
+    if (writer.ring.fd != -1 && !_uringSubmitAndWait(writer.ring, numOps, results))
+        _uringExit(writer.ring);
+
+    for (unsigned k = 0; k < batch.size(); ++k)
+    {
+        PendingRegion_ & region = batch[k];
+        bool ok = region.results[1] >= 0 && region.results[2] == (int)region.data.size() && region.results[3] >= 0;
+        if (!ok && !_writeRegionFiles(writer, region.dirFd, region.dirPath, region.data))
+            ++writer.numFailed;
+        if (region.dirFd != writer.prefixFd)
+            ::close(region.dirFd);
+    }
+    batch.clear();
+}
+
+// ----------------------------------------------------------------------------
+// Function _queueRegion()
+// ----------------------------------------------------------------------------
+
+template <typename TName>
+inline void
+_queueRegion(OutputWriter & writer, int dirFd, TName const & regionName, std::string const & data)
+{
+    std::lock_guard<std::mutex> lock(writer.batchMutex);
+
+    writer.batch.push_back(PendingRegion_());
+    PendingRegion_ & region = writer.batch.back();
+    region.dirFd = dirFd;
+    region.dirPath.assign(begin(regionName, Standard()), end(regionName, Standard()));
+    region.filePath = region.dirPath + '/';
+    region.filePath.append(begin(writer.indexFileName, Standard()), end(writer.indexFileName, Standard()));
+    if (!empty(writer.linkName))
+    {
+        region.linkPath = region.dirPath + '/';
+        region.linkPath.append(begin(writer.linkName, Standard()), end(writer.linkName, Standard()));
+    }
+    region.data = data;
+
+    if (writer.batch.size() == URING_BATCH_SIZE)
+        _flushBatch(writer);
+}
+
+#endif  // #if CHOPBAI_HAS_IO_URING
+
+// ----------------------------------------------------------------------------
+// Function flush()
+// ----------------------------------------------------------------------------
+
+// Writes all queued regions. Returns false if a queued region could not be
+// written since the writer was opened.
+
+inline bool
+flush(OutputWriter & writer)
+{
+#if CHOPBAI_HAS_IO_URING
+    std::lock_guard<std::mutex> lock(writer.batchMutex);
+    _flushBatch(writer);
+#endif
+    return writer.numFailed == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Function writeRegion()
+// ----------------------------------------------------------------------------
+
+// Creates the directory of the region and writes data as its index file. With
+// io_uring, the region is queued and errors are reported by flush().
+
+template <typename TName>
+inline bool
+writeRegion(OutputWriter & writer, TName const & regionName, std::string const & data)
+{
+    int dirFd = _parentDirectory(writer, regionName);
+    if (dirFd == -1)
+    {
+        SEQAN_OMP_PRAGMA(critical (cerr))
+        std::cerr << "ERROR: Could not create output directory for region " << regionName << std::endl;
+        return false;
+    }
+
+#if CHOPBAI_HAS_IO_URING
+    if (writer.useUring)
+    {
+        _queueRegion(writer, dirFd, regionName, data);
+        return true;
+    }
+#endif
+
+    std::string path(begin(regionName, Standard()), end(regionName, Standard()));
+    bool ok = _writeRegionFiles(writer, dirFd, path, data);
+
+    if (dirFd != writer.prefixFd)
+        ::close(dirFd);
+
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Function close()
+// ----------------------------------------------------------------------------
+
+inline void
+close(OutputWriter & writer)
+{
+    flush(writer);
+#if CHOPBAI_HAS_IO_URING
+    _uringExit(writer.ring);
+#endif
+    writer.useUring = false;
+
+    for (unsigned i = 0; i < length(writer.fanOutFds); ++i)
+        if (writer.fanOutFds[i] != -1)
+            ::close(writer.fanOutFds[i]);
+    clear(writer.fanOutFds);
+
+    if (writer.prefixFd != -1)
+        ::close(writer.prefixFd);
+    writer.prefixFd = -1;
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_OUTPUT_WRITER_H_
@@ -0,0 +1,535 @@
+#ifndef CHOPBAI_REGION_READER_H_
+#define CHOPBAI_REGION_READER_H_
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Helper Class BgzfBlock_
+// ----------------------------------------------------------------------------
+
+// A BGZF block of a batch and the part of its inflated data within the range.
+
+struct BgzfBlock_
+{
+    size_t bufferPos;          // Position of the compressed block in the batch.
+    unsigned size;             // Compressed size including header and footer.
+    unsigned beg;              // Part of the inflated data within the range.
+    unsigned end;
+    unsigned inflatedSize;
+    bool ok;
+};
+
+// ----------------------------------------------------------------------------
+// Class RegionReader
+// ----------------------------------------------------------------------------
+
+// Reads the alignments overlapping a region from a bam file. The file ranges
+// that the index gives for the region are computed up front and read in batches
+// of readahead bytes, while the kernel is asked to prefetch the next batch. The
+// BGZF blocks of a batch are inflated by numThreads threads; the alignments are
+// returned in file order.
+
+struct RegionReader
+{
+    int fd;
+    __uint64 fileSize;
+    unsigned numThreads;
+    size_t readahead;
+
+    // The region and the ranges of virtual file offsets to read.
+    __int32 refId;
+    __uint32 beg;
+    __uint32 end;
+    String<Pair<__uint64, __uint64> > ranges;
+    String<Pair<__uint32, __uint32> > binRanges;
+    size_t rangeIdx;           // Range of the next batch.
+    __uint64 nextOffset;       // File offset of the next block within the range.
+
+    String<char> compressed;   // Compressed data of the current batch.
+    String<BgzfBlock_> blocks;
+    String<char> inflated;     // Inflated blocks of the batch, 64 kb per block.
+    String<char> data;         // Inflated data within the ranges, not yet returned.
+    size_t dataPos;
+
+    bool atEnd;
+    bool error;
+
+    RegionReader() :
+        fd(-1), fileSize(0), numThreads(1), readahead(16u << 20), refId(-1), beg(0), end(0), rangeIdx(0),
+        nextOffset(0), dataPos(0), atEnd(true), error(false)
+    {}
+
+    ~RegionReader()
+    {
+        if (fd != -1)
+            ::close(fd);
+    }
+};
+
+// ============================================================================
+// Metafunctions
+// ============================================================================
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function _bgzfBlockSize()
+// ----------------------------------------------------------------------------
+
+// Returns the compressed size of the BGZF block starting at data, or 0 if data
+// does not start with a BGZF header. At least 18 bytes must be available.
+
+inline unsigned
+_bgzfBlockSize(char const * data, size_t available)
+{
+    unsigned char const * p = reinterpret_cast<unsigned char const *>(data);
+    if (p[0] != 31u || p[1] != 139u || p[2] != 8u || (p[3] & 4u) == 0u)
+        return 0;
+
+    // Look for the 'BC' subfield holding the block size in the extra field.
+    unsigned xlen = p[10] | (p[11] << 8);
+    for (unsigned i = 12; i + 6 <= 12 + xlen && i + 6 <= available; )
+    {
+        unsigned slen = p[i + 2] | (p[i + 3] << 8);
+        if (p[i] == 66u && p[i + 1] == 67u && slen == 2)
+            return (p[i + 4] | (p[i + 5] << 8)) + 1;
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Function _inflateBgzfBlock()
+// ----------------------------------------------------------------------------
+
+// Inflates a complete BGZF block of size bytes into out, which holds 64 kb.
+// Returns the number of inflated bytes or -1 on error.
+
+inline int
+_inflateBgzfBlock(char * out, char const * block, unsigned size)
+{
+    unsigned xlen = static_cast<unsigned char>(block[10]) | (static_cast<unsigned char>(block[11]) << 8);
+    unsigned headerSize = 12 + xlen;
+    if (size < headerSize + 8)
+        return -1;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return -1;
+
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block + headerSize));
+    zs.avail_in = size - headerSize - 8;
+    zs.next_out = reinterpret_cast<Bytef *>(out);
+    zs.avail_out = 65536;
+    int status = inflate(&zs, Z_FINISH);
+    int inflatedSize = 65536 - zs.avail_out;
+    inflateEnd(&zs);
+    if (status != Z_STREAM_END)
+        return -1;
+
+    // Check the inflated size against the footer.
+    __uint32 isize = 0;
+    memcpy(&isize, block + size - 4, 4);
+    return (isize == (__uint32)inflatedSize) ? inflatedSize : -1;
+}
+
+// ----------------------------------------------------------------------------
+// Function _appendBytes()
+// ----------------------------------------------------------------------------
+
+inline void
+_appendBytes(String<char> & target, char const * bytes, size_t numBytes)
+{
+    if (numBytes == 0)
+        return;
+    size_t oldLength = length(target);
+    resize(target, oldLength + numBytes);
+    memcpy(&target[oldLength], bytes, numBytes);
+}
+
+// ----------------------------------------------------------------------------
+// Function _readFully()
+// ----------------------------------------------------------------------------
+
+// Reads up to length bytes at offset. Returns the number of bytes read or -1.
+
+inline ssize_t
+_readFully(int fd, char * buffer, size_t length, __uint64 offset)
+{
+    size_t numRead = 0;
+    while (numRead < length)
+    {
+        ssize_t res = ::pread(fd, buffer + numRead, length - numRead, offset + numRead);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -1;
+        if (res == 0)
+            break;
+        numRead += res;
+    }
+    return numRead;
+}
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+// Opens the bam file. Batches of readahead bytes, at least 128 kb, are read and
+// inflated with numThreads threads.
+
+inline bool
+open(RegionReader & reader, char const * bamfile, unsigned numThreads, size_t readahead)
+{
+    if (reader.fd != -1)
+        ::close(reader.fd);
+
+    reader.fd = ::open(bamfile, O_RDONLY);
+    if (reader.fd == -1)
+        return false;
+
+    struct stat st;
+    if (::fstat(reader.fd, &st) != 0)
+        return false;
+    reader.fileSize = st.st_size;
+    reader.numThreads = _max(numThreads, 1u);
+    reader.readahead = _max(readahead, (size_t)(2u << 16));
+    reader.atEnd = true;
+    reader.error = false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function readHeader()
+// ----------------------------------------------------------------------------
+
+// Reads the inflated bam header from the start of the file: the magic string,
+// the header text and the reference sequence dictionary. This is the decoder of
+// the bam header for all of chopBAI. Sizes in the header that the file cannot
+// hold are rejected before the header is read further: the data of a BGZF block
+// is at most 64 kb and takes at least 28 bytes of the file.
+
+inline bool
+readHeader(String<char> & header, RegionReader & reader)
+{
+    clear(header);
+    String<char> block;
+    resize(block, 65536);
+    String<char> out;
+    resize(out, 65536);
+
+    __uint64 offset = 0;
+    __int64 maxBytes = ((__int64)reader.fileSize / 28 + 1) * 65536;
+    bool textRead = false;
+    size_t refPos = 0;         // Position of the next reference entry.
+    __int32 numRefs = -1;
+
+    while (true)
+    {
+        // Parse what is there.
+        if (!textRead && length(header) >= 8)
+        {
+            __int32 lText = 0;
+            memcpy(&lText, &header[4], 4);
+            if (strncmp(&header[0], "BAM\1", 4) != 0 || lText < 0 || lText > maxBytes)
+                return false;
+            refPos = 12 + lText;
+            textRead = true;
+        }
+        if (textRead && numRefs < 0 && length(header) >= refPos)
+        {
+            // Each reference entry takes at least 9 bytes.
+            memcpy(&numRefs, &header[refPos - 4], 4);
+            if (numRefs < 0 || (__int64)numRefs * 9 > maxBytes - (__int64)refPos)
+                return false;
+        }
+        while (numRefs > 0 && length(header) >= refPos + 4)
+        {
+            __int32 lName = 0;
+            memcpy(&lName, &header[refPos], 4);
+            if (lName < 1 || lName > maxBytes - (__int64)refPos - 8)
+                return false;
+            if (length(header) < refPos + 8 + lName)
+                break;
+            refPos += 8 + lName;
+            --numRefs;
+        }
+        if (numRefs == 0)
+        {
+            resize(header, refPos);
+            return true;
+        }
+
+        // Inflate the next block.
+        ssize_t numRead = _readFully(reader.fd, &block[0], 65536, offset);
+        if (numRead < 18)
+            return false;
+        unsigned size = _bgzfBlockSize(&block[0], numRead);
+        if (size == 0 || size > (size_t)numRead)
+            return false;
+        int inflatedSize = _inflateBgzfBlock(&out[0], &block[0], size);
+        if (inflatedSize <= 0)
+            return false;
+        _appendBytes(header, &out[0], inflatedSize);
+        offset += size;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Function setRegion()
+// ----------------------------------------------------------------------------
+
+// Computes the file ranges of the region [beg, end) on reference refId and asks
+// the kernel to read ahead the first batch.
+
+template <typename TTag>
+inline void
+setRegion(RegionReader & reader, BamIndex<TTag> const & index, __int32 refId, __uint32 beg, __uint32 end)
+{
+    reader.refId = refId;
+    reader.beg = beg;
+    reader.end = end;
+    queryChunks(reader.ranges, reader.binRanges, index, refId, beg, end);
+    reader.rangeIdx = 0;
+    reader.nextOffset = empty(reader.ranges) ? 0 : reader.ranges[0].i1 >> 16;
+    clear(reader.data);
+    reader.dataPos = 0;
+    reader.atEnd = empty(reader.ranges);
+    reader.error = false;
+
+    if (!reader.atEnd)
+        ::posix_fadvise(reader.fd, reader.nextOffset, reader.readahead, POSIX_FADV_WILLNEED);
+}
+
+// ----------------------------------------------------------------------------
+// Function _readBatch()
+// ----------------------------------------------------------------------------
+
+// Reads the next batch of blocks of the current range, inflates them in parallel
+// and appends their data within the range to reader.data. Returns false on error.
+
+inline bool
+_readBatch(RegionReader & reader)
+{
+    Pair<__uint64, __uint64> const & range = reader.ranges[reader.rangeIdx];
+    __uint64 firstBlock = range.i1 >> 16;
+    __uint64 lastBlock = range.i2 >> 16;
+    unsigned lastEnd = range.i2 & 0xffff;  // The last block is not needed if 0.
+
+    // The range may end at the block where the previous batch stopped.
+    __uint64 offset = reader.nextOffset;
+    if (offset > lastBlock || (offset == lastBlock && lastEnd == 0))
+    {
+        ++reader.rangeIdx;
+        if (reader.rangeIdx < length(reader.ranges))
+            reader.nextOffset = reader.ranges[reader.rangeIdx].i1 >> 16;
+        return true;
+    }
+
+    // Read up to readahead bytes, covering the last block of the range if possible.
+    size_t toRead = _min((__uint64)reader.readahead, lastBlock - offset + 65536u);
+    toRead = _min((__uint64)toRead, reader.fileSize - _min(offset, reader.fileSize));
+    resize(reader.compressed, toRead);
+    ssize_t numRead = (toRead > 0) ? _readFully(reader.fd, &reader.compressed[0], toRead, offset) : 0;
+    if (numRead <= 0)
+        return false;
+
+    // Find the complete blocks of the range in the batch.
+    clear(reader.blocks);
+    bool rangeDone = false;
+    size_t pos = 0;
+    while (pos + 18 <= (size_t)numRead)
+    {
+        __uint64 blockOffset = offset + pos;
+        if (blockOffset > lastBlock || (blockOffset == lastBlock && lastEnd == 0))
+        {
+            rangeDone = true;
+            break;
+        }
+
+        BgzfBlock_ block;
+        block.bufferPos = pos;
+        block.size = _bgzfBlockSize(&reader.compressed[pos], numRead - pos);
+        if (block.size == 0)
+            return false;
+        if (pos + block.size > (size_t)numRead)
+            break;
+        block.beg = (blockOffset == firstBlock) ? range.i1 & 0xffff : 0;
+        block.end = (blockOffset == lastBlock) ? lastEnd : 65536;
+        appendValue(reader.blocks, block);
+        pos += block.size;
+
+        if (blockOffset == lastBlock)
+        {
+            rangeDone = true;
+            break;
+        }
+    }
+    if (empty(reader.blocks) && !rangeDone)
+        return false;  // Truncated file.
+    reader.nextOffset = offset + pos;
+
+    // Prefetch the next batch while this one is inflated.
+    if (rangeDone && reader.rangeIdx + 1 < length(reader.ranges))
+        ::posix_fadvise(reader.fd, reader.ranges[reader.rangeIdx + 1].i1 >> 16, reader.readahead, POSIX_FADV_WILLNEED);
+    else if (!rangeDone)
+        ::posix_fadvise(reader.fd, reader.nextOffset, reader.readahead, POSIX_FADV_WILLNEED);
+
+    // Inflate the blocks.
+    int numBlocks = length(reader.blocks);
+    resize(reader.inflated, (size_t)numBlocks << 16);
+    SEQAN_OMP_PRAGMA(parallel for num_threads(reader.numThreads) schedule(static) if (numBlocks > 1))
+    for (int i = 0; i < numBlocks; ++i)
+    {
+        BgzfBlock_ & block = reader.blocks[i];
+        int size = _inflateBgzfBlock(&reader.inflated[(size_t)i << 16], &reader.compressed[block.bufferPos], block.size);
+        block.ok = (size >= 0);
+        block.inflatedSize = _max(size, 0);
+    }
+
+    // Append the data within the range.
+    for (int i = 0; i < numBlocks; ++i)
+    {
+        BgzfBlock_ const & block = reader.blocks[i];
+        unsigned end = _min(block.end, block.inflatedSize);
+        if (!block.ok || block.beg > end)
+            return false;
+        _appendBytes(reader.data, &reader.inflated[((size_t)i << 16) + block.beg], end - block.beg);
+    }
+
+    if (rangeDone)
+    {
+        ++reader.rangeIdx;
+        if (reader.rangeIdx < length(reader.ranges))
+            reader.nextOffset = reader.ranges[reader.rangeIdx].i1 >> 16;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function _alignmentEnd()
+// ----------------------------------------------------------------------------
+
+// Returns the end position of the alignment record, which starts with its
+// block_size. Alignments without reference-consuming CIGAR operations cover one
+// position. Returns -1 if the CIGAR string exceeds the record.
+
+inline __int64
+_alignmentEnd(char const * record, __int32 blockSize, __int32 pos)
+{
+    unsigned lReadName = static_cast<unsigned char>(record[12]);
+    __uint16 nCigarOp = 0;
+    memcpy(&nCigarOp, record + 16, 2);
+    if (36 + lReadName + 4 * nCigarOp > 4 + (unsigned)blockSize)
+        return -1;
+
+    __int64 refLength = 0;
+    char const * cigar = record + 36 + lReadName;
+    for (unsigned i = 0; i < nCigarOp; ++i)
+    {
+        __uint32 op = 0;
+        memcpy(&op, cigar + 4 * i, 4);
+        switch (op & 0xf)
+        {
+            case 0: case 2: case 3: case 7: case 8:  // M, D, N, =, X
+                refLength += op >> 4;
+        }
+    }
+    return (__int64)pos + _max(refLength, (__int64)1);
+}
+
+// ----------------------------------------------------------------------------
+// Function readRecord()
+// ----------------------------------------------------------------------------
+
+// Reads the next alignment overlapping the region as binary bam record including
+// its block_size. Returns false at the end of the region or on error, which sets
+// reader.error.
+
+inline bool
+readRecord(String<char> & record, RegionReader & reader)
+{
+    while (!reader.atEnd)
+    {
+        // Read the next batch unless a complete record is available.
+        size_t available = length(reader.data) - reader.dataPos;
+        __int32 blockSize = 0;
+        if (available >= 4)
+            memcpy(&blockSize, &reader.data[reader.dataPos], 4);
+        if (available < 4 || available < 4 + (size_t)_max(blockSize, 0))
+        {
+            if (reader.rangeIdx >= length(reader.ranges))
+            {
+                reader.error = (available != 0);
+                reader.atEnd = true;
+                break;
+            }
+            erase(reader.data, 0, reader.dataPos);
+            reader.dataPos = 0;
+            if (!_readBatch(reader))
+            {
+                reader.error = true;
+                reader.atEnd = true;
+            }
+            continue;
+        }
+        if (blockSize < 32)
+        {
+            reader.error = true;
+            reader.atEnd = true;
+            break;
+        }
+
+        char const * data = &reader.data[reader.dataPos];
+        reader.dataPos += 4 + blockSize;
+
+        __int32 refId = 0, pos = 0;
+        memcpy(&refId, data + 4, 4);
+        memcpy(&pos, data + 8, 4);
+
+        // The bam file is sorted; stop behind the region.
+        if (refId != reader.refId)
+        {
+            if (refId == -1 || refId > reader.refId)
+                reader.atEnd = true;
+            continue;
+        }
+        if ((__int64)pos >= (__int64)reader.end)
+        {
+            reader.atEnd = true;
+            break;
+        }
+        __int64 alignmentEnd = _alignmentEnd(data, blockSize, pos);
+        if (alignmentEnd < 0)
+        {
+            reader.error = true;
+            reader.atEnd = true;
+            break;
+        }
+        if (alignmentEnd <= (__int64)reader.beg)
+            continue;
+
+        clear(record);
+        _appendBytes(record, data, 4 + blockSize);
+        return true;
+    }
+    return false;
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_REGION_READER_H_
@@ -0,0 +1,112 @@
+#ifndef CHOPBAI_SHARED_INDEX_H_
+#define CHOPBAI_SHARED_INDEX_H_
+
+#include <memory>
+
+#include "index_query.h"
+
+// An index that many threads query at the same time. The queries only read the
+// index: the bin maps are searched with const lookups, which the standard library
+// allows concurrently, and all temporary lists live in buffers of the calling
+// thread. No locks are taken, and the index is held in memory once.
+
+namespace seqan {
+
+// ============================================================================
+// Tags, Classes, Enums
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Class IndexQueryBuffers
+// ----------------------------------------------------------------------------
+
+// Scratch space of one thread for queries on a shared index. The strings keep
+// their capacity across queries, so that repeated queries do not allocate.
+
+struct IndexQueryBuffers
+{
+    String<Pair<__uint32, __uint32> > binRanges;   // Candidate bins of the query.
+};
+
+// ----------------------------------------------------------------------------
+// Class SharedBamIndex
+// ----------------------------------------------------------------------------
+
+// A loaded bai or csi index that cannot be modified. Copies refer to the same
+// index, which is released with the last copy.
+
+template <typename TTag>
+struct SharedBamIndex
+{
+    std::shared_ptr<BamIndex<TTag> const> index;
+};
+
+// ============================================================================
+// Functions
+// ============================================================================
+
+// ----------------------------------------------------------------------------
+// Function open()
+// ----------------------------------------------------------------------------
+
+template <typename TTag>
+inline bool
+open(SharedBamIndex<TTag> & shared, char const * filename)
+{
+    std::shared_ptr<BamIndex<TTag> > index(new BamIndex<TTag>());
+    if (!open(*index, filename))
+        return false;
+    shared.index = index;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Function queryRegion()
+// ----------------------------------------------------------------------------
+
+// Resolves the region to the sorted, merged file ranges a reader visits, as
+// queryChunks().
+
+template <typename TTag>
+inline void
+queryRegion(String<Pair<__uint64, __uint64> > & ranges, IndexQueryBuffers & buffers, BamIndex<TTag> const & index,
+            GenomicInterval const & interval)
+{
+    queryChunks(ranges, buffers.binRanges, index, interval.chrId, interval.begin, interval.end);
+}
+
+template <typename TTag>
+inline void
+queryRegion(String<Pair<__uint64, __uint64> > & ranges, IndexQueryBuffers & buffers,
+            SharedBamIndex<TTag> const & shared, GenomicInterval const & interval)
+{
+    queryRegion(ranges, buffers, *shared.index, interval);
+}
+
+// ----------------------------------------------------------------------------
+// Function cropRegion()
+// ----------------------------------------------------------------------------
+
+// Writes the reduced index for the region to outIndex, replacing its content.
+
+template <typename TTag>
+inline void
+cropRegion(BamIndex<TTag> & outIndex, IndexQueryBuffers & buffers, BamIndex<TTag> const & index,
+           GenomicInterval const & interval, bool writeLinear)
+{
+    outIndex = BamIndex<TTag>();
+    getCandidateBinRanges(buffers.binRanges, interval.begin, interval.end, index);
+    cropInterval(outIndex, index, interval, buffers.binRanges, writeLinear);
+}
+
+template <typename TTag>
+inline void
+cropRegion(BamIndex<TTag> & outIndex, IndexQueryBuffers & buffers, SharedBamIndex<TTag> const & shared,
+           GenomicInterval const & interval, bool writeLinear)
+{
+    cropRegion(outIndex, buffers, *shared.index, interval, writeLinear);
+}
+
+}  // namespace seqan
+
+#endif  // #ifndef CHOPBAI_SHARED_INDEX_H_
@@ -16,3 +16,220 @@ for opts in "" "--linear" "--symlink" "--linear --symlink"; do
     done
   done
 done
+
+# Test a region file mixing both region formats
+echo "Testing chopBAI with a region file"
+printf "chrB:1-100\n# comment\nchrA:B\t999\t10000\n" > regions.txt
+for reg in chrB:1-100 chrA:B:1000-10000; do
+  rm -rf ./${reg}
+done
+../chopBAI test.sorted.bam regions.txt
+for reg in chrB:1-100 chrA:B:1000-10000; do
+  if [[ ! -f ${reg}/test.sorted.bam.bai ]]; then
+    echo "Index for ${reg} was not created."
+    exit 1
+  fi
+  (cd ${reg} && ln -sf ../test.sorted.bam && samtools view test.sorted.bam ${reg} > out.chopBAI.sam \
+    && samtools view ../test.sorted.bam ${reg} > out.samtools.sam && diff -q out.chopBAI.sam out.samtools.sam)
+done
+rm -f regions.txt
+
+# Test reading the reference names from a .fai or .dict file
+echo "Testing chopBAI with a contigs file"
+samtools faidx test.fa
+samtools dict test.fa > test.dict
+./test.sh chrB:1-100 -c test.fa.fai
+./test.sh chrA:B:1,000-10,000 -c test.dict
+head -n 2 test.fa.fai > truncated.fai
+if ../chopBAI -c truncated.fai -p contigs test.sorted.bam chrA:B:1-100 2> /dev/null; then
+  echo "Chopping with a contigs file listing too few references did not fail."
+  exit 1
+fi
+if ../chopBAI -c test.dict -p contigs test.sorted.bam chrA:B:C:D:1-1000 2> /dev/null; then
+  echo "Chopping a region passing the reference length in the contigs file did not fail."
+  exit 1
+fi
+rm -rf contigs test.fa.fai test.dict truncated.fai
+
+# Test cohort mode
+echo "Testing chopBAI in cohort mode"
+rm -rf ./cohort
+mkdir cohort
+printf "sampleA\ttest.sorted.bam\ntest.sorted.bam\n" > bams.txt
+# Compare against the outputs of the last --linear run above.
+../chopBAI -b -l -t 2 -p cohort bams.txt chrB chrA:B:1-100
+for sample in sampleA test.sorted; do
+  for reg in chrB chrA:B:1-100; do
+    if ! cmp -s cohort/${sample}/${reg}/test.sorted.bam.bai ${reg}/test.sorted.bam.bai; then
+      echo "Cohort index for ${sample} ${reg} differs."
+      exit 1
+    fi
+  done
+done
+rm -rf bams.txt cohort
+
+# Test optimized indices, which have clipped, trimmed and merged chunks
+echo "Testing chopBAI with optimization"
+./test.sh chrB:1-100 -O
+./test.sh chrA:B:1,000-10,000 -O
+./test.sh chrB -O
+./test.sh chrA:B -O --linear
+
+# Test the built-in verification of plain and optimized indices
+echo "Testing chopBAI with verification"
+rm -rf ./verify
+mkdir verify
+../chopBAI -V -t 2 -p verify test.sorted.bam chrB chrA:B:1-100 chrA:B:C:D:1,000-10,000
+../chopBAI -V -O -l -t 2 -p verify test.sorted.bam chrB chrA:B:1-100 chrA:B:C:D:1,000-10,000
+rm -rf verify
+
+# Test the profile subcommand
+echo "Testing chopBAI profile"
+../chopBAI profile -w 1000 test.sorted.bam | grep -q "^window"
+../chopBAI profile -j -O test.sorted.bam | python -m json.tool > /dev/null
+
+# Test sharding by compressed bytes
+echo "Testing chopBAI with shards"
+rm -rf ./shards
+mkdir shards
+../chopBAI -n 4 -V -p shards test.sorted.bam chrA:B:C:D chrB
+ls shards | grep -q "^chrA:B:C:D:"
+rm -rf shards
+
+# Test the index cache: the first run writes it, the second loads from it
+echo "Testing chopBAI with index cache"
+rm -rf ./cached test.sorted.bam.bai.chopcache
+mkdir cached
+for run in 1 2; do
+  ../chopBAI -C -l -p cached test.sorted.bam chrB chrA:B:1-100
+  for reg in chrB chrA:B:1-100; do
+    if ! cmp -s cached/${reg}/test.sorted.bam.bai ${reg}/test.sorted.bam.bai; then
+      echo "Index for ${reg} from the index cache differs."
+      exit 1
+    fi
+  done
+done
+test -f test.sorted.bam.bai.chopcache
+rm -rf cached test.sorted.bam.bai.chopcache
+
+# Test writing with io_uring, which falls back to synchronous writes if unavailable
+echo "Testing chopBAI with io_uring"
+rm -rf ./uring
+mkdir uring
+../chopBAI --io-uring -l -s -f -p uring test.sorted.bam chrB chrA:B:1-100
+for reg in chrB chrA:B:1-100; do
+  if ! cmp -s uring/*/*/${reg}/test.sorted.bam.bai ${reg}/test.sorted.bam.bai; then
+    echo "Index for ${reg} written with io_uring differs."
+    exit 1
+  fi
+done
+rm -rf uring
+
+# Test keeping the metabins and unaligned count for seeking to the unmapped reads
+echo "Testing chopBAI with unmapped read information"
+rm -rf ./unmapped
+mkdir unmapped
+../chopBAI -u -s -p unmapped test.sorted.bam chrB:1-100
+samtools idxstats test.sorted.bam > unmapped/idxstats.full
+(cd unmapped/chrB:1-100 && samtools idxstats test.sorted.bam) > unmapped/idxstats.chopped
+diff -q unmapped/idxstats.full unmapped/idxstats.chopped
+rm -rf unmapped
+
+# Test adding the mates of the regions' reads
+echo "Testing chopBAI with mates"
+./test.sh chrA:B:1,000-10,000 --mates
+./test.sh chrB:1-100 --mates --linear --max-mate-windows 2
+
+# Test reading the alignments of a region with a chopped index
+echo "Testing chopBAI view"
+rm -rf ./view
+mkdir view
+../chopBAI -s -p view test.sorted.bam chrB:1-100 chrA:B:C:D:1,000-10,000
+for reg in chrB:1-100 chrA:B:C:D:1,000-10,000; do
+  ../chopBAI view -t 2 -r 1 view/${reg}/test.sorted.bam ${reg} | samtools view - > view/out.view.sam
+  samtools view test.sorted.bam ${reg} > view/out.samtools.sam
+  diff -q view/out.view.sam view/out.samtools.sam
+  test "$(../chopBAI view -c view/${reg}/test.sorted.bam ${reg} | cut -f 2)" = "$(samtools view -c test.sorted.bam ${reg})"
+done
+rm -rf view
+
+# Test splitting the index per reference in one pass
+echo "Testing chopBAI split"
+rm -rf ./split ./regions
+mkdir split regions
+../chopBAI split -l -p split test.sorted.bam
+../chopBAI -l -p regions test.sorted.bam chrA:B:C:D chrA:B chrB
+for reg in chrA:B:C:D chrA:B chrB; do
+  if ! cmp -s split/${reg}/test.sorted.bam.bai regions/${reg}/test.sorted.bam.bai; then
+    echo "Index for ${reg} from split differs."
+    exit 1
+  fi
+done
+rm -rf split regions
+
+# Test rebuilding the index as CSI with finer bins
+echo "Testing chopBAI with a rebuilt CSI"
+rm -rf ./csi
+mkdir csi
+../chopBAI --csi-min-shift 12 -s -p csi test.sorted.bam chrB:1-100 chrA:B:C:D:1,000-10,000 chrA:B
+for reg in chrB:1-100 chrA:B:C:D:1,000-10,000 chrA:B; do
+  test -f csi/${reg}/test.sorted.bam.csi
+  (cd csi/${reg} && samtools view test.sorted.bam ${reg}) > csi/out.csi.sam
+  samtools view test.sorted.bam ${reg} > csi/out.samtools.sam
+  diff -q csi/out.csi.sam csi/out.samtools.sam
+done
+rm -rf csi
+
+# Test chopping the index files written to a watched directory
+echo "Testing chopBAI watch mode"
+rm -rf ./watch
+mkdir -p watch/in watch/out
+../chopBAI -w -t 2 -l -p watch/out watch/in chrB:1-100 chrA:B &
+pid=$!
+sleep 1
+cp test.sorted.bam test.sorted.bam.bai watch/in/
+for i in $(seq 1 100); do
+  test -f watch/out/test.sorted/chrA:B/test.sorted.bam.bai && break
+  sleep 0.1
+done
+kill -INT $pid
+wait $pid
+../chopBAI -l -p watch test.sorted.bam chrB:1-100 chrA:B
+for reg in chrB:1-100 chrA:B; do
+  if ! cmp -s watch/out/test.sorted/${reg}/test.sorted.bam.bai watch/${reg}/test.sorted.bam.bai; then
+    echo "Index for ${reg} from watch mode differs."
+    exit 1
+  fi
+done
+rm -rf watch
+
+# Test estimating read counts from the index alone
+echo "Testing chopBAI count"
+../chopBAI count -t 2 test.sorted.bam chrA:B chrB:1-100 > count.txt
+samtools idxstats test.sorted.bam | awk '$1 != "*"' > count.idxstats
+awk '$1 == "reference"' count.txt | cut -f 2,4-6 | diff -q - count.idxstats
+test "$(awk '$1 == "region" && $2 == "chrA:B"' count.txt | cut -f 5)" = "$(samtools view -c test.sorted.bam chrA:B)"
+rm count.txt count.idxstats
+
+# Test re-chopping regions within the region of a reduced index
+echo "Testing chopBAI re-chopping a reduced index"
+rm -rf ./rechop
+mkdir -p rechop/arm rechop/sub rechop/full
+../chopBAI -l -s -p rechop/arm test.sorted.bam chrB:1-50,000
+../chopBAI -R -l -p rechop/sub rechop/arm/chrB:1-50,000/test.sorted.bam chrB:1-100 chrB:20,000-30,000
+../chopBAI -l -p rechop/full test.sorted.bam chrB:1-100 chrB:20,000-30,000
+for reg in chrB:1-100 chrB:20,000-30,000; do
+  if ! cmp -s rechop/sub/${reg}/test.sorted.bam.bai rechop/full/${reg}/test.sorted.bam.bai; then
+    echo "Index for ${reg} re-chopped from a reduced index differs."
+    exit 1
+  fi
+done
+if ../chopBAI -R -p rechop/sub rechop/arm/chrB:1-50,000/test.sorted.bam chrB:40,000-60,000 2> /dev/null; then
+  echo "Re-chopping a region outside the parent region did not fail."
+  exit 1
+fi
+if ../chopBAI -R -m -p rechop/sub rechop/arm/chrB:1-50,000/test.sorted.bam chrB:1-100 2> /dev/null; then
+  echo "Re-chopping with mates did not fail."
+  exit 1
+fi
+rm -rf rechop